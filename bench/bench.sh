@@ -0,0 +1,85 @@
+#!/bin/bash
+#
+# end-to-end benchmark: runs subberthehut against the local mock server
+# over a synthetic library and reports the throughput.
+#
+# Environment:
+#   BENCH_FILES    number of videos in the library (default 200)
+#   BENCH_LATENCY  latency of every call in ms (default 50)
+#   BENCH_SLOW     percent of the calls which take BENCH_SLOW_LATENCY instead,
+#                  for a long tail, e.g. to measure --hedge (default 0)
+#   BENCH_SLOW_LATENCY  latency of the slow calls in ms (default 2000)
+#   BENCH_RESULTS  results per query (default 10)
+#   BENCH_PAYLOAD  size of every subtitle in bytes (default 51200)
+#   BENCH_PORT     port of the mock server (default 8931)
+#   BENCH_ARGS     additional options for subberthehut (default "-b 10 -j 4"),
+#                  e.g. "-b 10 -j 4 -l eng,ger --per-language"
+#   BENCH_TRACE    write a Chrome trace of the run to this file (optional)
+#   BENCH_SERVERS  latencies in ms of more mock servers on the next ports,
+#                  which are searched at the same time (optional, e.g. "20 500")
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+files=${BENCH_FILES:-200}
+latency=${BENCH_LATENCY:-50}
+slow=${BENCH_SLOW:-0}
+slow_latency=${BENCH_SLOW_LATENCY:-2000}
+results=${BENCH_RESULTS:-10}
+payload=${BENCH_PAYLOAD:-51200}
+port=${BENCH_PORT:-8931}
+args=${BENCH_ARGS:--b 10 -j 4}
+trace=${BENCH_TRACE:+--trace $BENCH_TRACE}
+
+tmp=$(mktemp -d)
+server_pids=()
+cleanup() {
+	[[ ${#server_pids[@]} -gt 0 ]] && kill "${server_pids[@]}" 2>/dev/null
+	rm -rf "$tmp"
+}
+trap cleanup EXIT
+
+# sparse videos, with a unique head so every file has its own hash
+mkdir "$tmp/library"
+for ((i = 0; i < files; i++)); do
+	f=$(printf "%s/library/Show.S01E%03d.720p.HDTV.x264-GROUP.mkv" "$tmp" "$i")
+	printf '%08d' "$i" > "$f"
+	truncate -s $((700 * 1024 * 1024 + i * 4096)) "$f"
+done
+
+urls=()
+latencies=("$latency" ${BENCH_SERVERS:-})
+for ((s = 0; s < ${#latencies[@]}; s++)); do
+	./bench/mock_server --port $((port + s)) --latency "${latencies[s]}" \
+		--slow "$slow" --slow-latency "$slow_latency" --results "$results" --payload-size "$payload" 2>/dev/null &
+	server_pids+=($!)
+	urls+=(--url "http://localhost:$((port + s))/RPC2")
+
+	# wait for the server
+	for ((i = 0; i < 50; i++)); do
+		if XDG_CACHE_HOME="$tmp/cache" ./subberthehut --url "http://localhost:$((port + s))/RPC2" -L >/dev/null 2>&1; then
+			break
+		fi
+		sleep 0.1
+	done
+done
+
+start=$(date +%s%N)
+# shellcheck disable=SC2086
+find "$tmp/library" -name '*.mkv' -print0 |
+	XDG_CACHE_HOME="$tmp/cache" ./subberthehut "${urls[@]}" \
+		-n -f -s -q -q -e -C none --search-cache-ttl 0 --rate 0 --stats $trace $args -0 -F - 2>"$tmp/stats" || true
+end=$(date +%s%N)
+
+elapsed_ms=$(((end - start) / 1000000))
+subs=$(find "$tmp/library" -name '*.srt' | wc -l)
+
+echo "files:       $files"
+echo "subtitles:   $subs"
+echo "latency:     ${latencies[*]} ms per call, $slow% of the calls $slow_latency ms"
+echo "options:     $args"
+echo "elapsed:     $elapsed_ms ms"
+awk -v n="$files" -v ms="$elapsed_ms" 'BEGIN { printf "throughput:  %.1f files/sec\n", ms > 0 ? n * 1000 / ms : 0 }'
+echo
+cat "$tmp/stats"
@@ -0,0 +1,332 @@
+/*
+ * microbench - runs the hot functions of subberthehut in isolation
+ *
+ * subberthehut.c is included directly, so its static functions can be
+ * called. Every benchmark prints one JSON object per line to stdout:
+ *
+ *   {"bench":"hash","size":1073741824,"iterations":...,"ns_per_op":...,"bytes_per_sec":...}
+ *
+ * The inputs are generated (sparse files, and a synthetic subtitle and
+ * search results from tests/fixtures.h), so the numbers are comparable
+ * between runs. Temporary files are created in $TMPDIR (default /tmp).
+ */
+
+#define main subberthehut_main
+#include "../subberthehut.c"
+#undef main
+
+#include "../tests/fixtures.h"
+
+// every benchmark runs for at least this long
+#define BENCH_MIN_NS  (500 * 1000 * 1000LL)
+
+static FILE *out; // the original stdout, stdout itself is used by print_table()
+
+static long long now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void report(const char *bench, long long size, long long iterations, long long ns, long long bytes) {
+	double ns_per_op = (double)ns / iterations;
+	double bytes_per_sec = ns > 0 ? bytes * 1e9 / ns : 0;
+
+	fprintf(out, "{\"bench\":\"%s\",\"size\":%lld,\"iterations\":%lld,\"ns_per_op\":%.1f,\"bytes_per_sec\":%.0f}\n",
+	        bench, size, iterations, ns_per_op, bytes_per_sec);
+	fflush(out);
+}
+
+/*
+ * get_hash_and_filesize() on a sparse file of the given size.
+ * The bytes per op are the bytes actually read.
+ */
+static int bench_hash(off_t size) {
+	_cleanup_free_ char *path = temp_path("video");
+	_cleanup_close_ int fd = -1;
+
+	if (!path)
+		return log_oom();
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd == -1 || ftruncate(fd, size) == -1) {
+		log_err("failed to create %s: %m", path);
+		unlink(path);
+		return errno;
+	}
+	unlink(path);
+
+	// the head and the tail are read
+	long long read_per_op = size < HASH_CHUNK ? size : 2 * HASH_CHUNK;
+	long long iterations = 0;
+	long long start = now_ns();
+	long long ns;
+	do {
+		uint64_t hash, filesize;
+		int r = get_hash_and_filesize(fd, &hash, &filesize);
+		if (r != 0) {
+			log_err("failed to hash: %s", strerror(r));
+			return r;
+		}
+		iterations++;
+	} while ((ns = now_ns() - start) < BENCH_MIN_NS);
+
+	report("hash", size, iterations, ns, iterations * read_per_op);
+	return 0;
+}
+
+/*
+ * sub_write() as it was before the base64 data was decoded in exact chunks,
+ * for comparison: it always passes ZLIB_CHUNK characters to the decoder
+ * and estimates the next offset from the decoded bytes. It reads past the
+ * end of the data, so the caller pads it with ZLIB_CHUNK NULs (which the
+ * decoder skips).
+ */
+static int sub_write_old(const char *sub_base64, const char *file_path) {
+	int z_ret;
+	z_stream z_strm;
+	unsigned char z_out[ZLIB_CHUNK];
+	unsigned char z_in[ZLIB_CHUNK];
+	z_strm.zalloc = Z_NULL;
+	z_strm.zfree = Z_NULL;
+	z_strm.opaque = Z_NULL;
+	z_strm.avail_in = 0;
+	z_strm.next_in = Z_NULL;
+
+	_cleanup_fclose_ FILE *f = NULL;
+	int r = 0;
+
+	f = fopen(file_path, "w+");
+	if (!f) {
+		log_err("failed to open output file %s: %m", file_path);
+		return errno;
+	}
+
+	z_ret = inflateInit2(&z_strm, 16 + MAX_WBITS);
+	if (z_ret != Z_OK) {
+		log_err("failed to init zlib (%i)", z_ret);
+		return z_ret;
+	}
+
+	int b64_state = 0;
+	unsigned int b64_save = 0;
+	unsigned int b64_offset = 0;
+	do {
+		z_strm.avail_in = g_base64_decode_step(&sub_base64[b64_offset], ZLIB_CHUNK, z_in, &b64_state, &b64_save);
+		b64_offset += z_strm.avail_in * 4 / 3;
+		if (z_strm.avail_in == 0)
+			break;
+
+		z_strm.next_in = z_in;
+
+		do {
+			z_strm.avail_out = ZLIB_CHUNK;
+			z_strm.next_out = z_out;
+			z_ret = inflate(&z_strm, Z_NO_FLUSH);
+
+			switch (z_ret) {
+			case Z_NEED_DICT:
+				z_ret = Z_DATA_ERROR;
+				// fallthrough
+			case Z_DATA_ERROR:
+			case Z_MEM_ERROR:
+				r = z_ret;
+				log_err("zlib error: %s (%d)", z_strm.msg, z_ret);
+				goto finish;
+			}
+			unsigned int have = ZLIB_CHUNK - z_strm.avail_out;
+
+			size_t written = fwrite(z_out, 1, have, f);
+			if (written != have) {
+				log_err("failed to write file: %m");
+				r = errno;
+				goto finish;
+			}
+		} while (z_strm.avail_out == 0);
+	} while (z_ret != Z_STREAM_END);
+
+finish:
+	inflateEnd(&z_strm);
+
+	return r;
+}
+
+/*
+ * sub_write() (base64 decoding, inflating, writing) of a subtitle of
+ * the given size, or sub_write_old() if old is set. The bytes per op are
+ * the bytes of the subtitle.
+ */
+static int bench_sub_write(size_t size, bool old) {
+	_cleanup_free_ char *path = temp_path("sub.srt");
+	_cleanup_free_ char *sub = make_sub(size);
+	char *payload = sub ? gzip_base64(sub, size) : NULL;
+
+	if (!path || !payload) {
+		g_free(payload);
+		return log_oom();
+	}
+
+	// the padding sub_write_old() reads
+	size_t payload_len = strlen(payload);
+	payload = g_realloc(payload, payload_len + ZLIB_CHUNK);
+	memset(payload + payload_len, 0, ZLIB_CHUNK);
+
+	long long iterations = 0;
+	long long start = now_ns();
+	long long ns;
+	int r = 0;
+	do {
+		r = old ? sub_write_old(payload, path) : sub_write(payload, payload_len, path);
+		if (r != 0)
+			break;
+		iterations++;
+	} while ((ns = now_ns() - start) < BENCH_MIN_NS);
+
+	if (r == 0)
+		report(old ? "sub_write_old" : "sub_write", size, iterations, ns, iterations * (long long)size);
+
+	unlink(path);
+	g_free(payload);
+	return r;
+}
+
+/*
+ * read_sub_infos() and free_sub_infos() on n search results, i.e. copying
+ * the used fields out of the xmlrpc tree into the arena of a job.
+ */
+static int bench_read_sub_infos(int n) {
+	_cleanup_xmlrpc_ xmlrpc_value *results = xmlrpc_array_new(&env);
+	struct file_job job = {0};
+	int r = 0;
+
+	for (int i = 0; i < n; i++) {
+		_cleanup_xmlrpc_ xmlrpc_value *result = make_result(i, i % 4 == 0);
+		xmlrpc_array_append_item(&env, results, result);
+	}
+	if (env.fault_occurred) {
+		log_err("failed to build results: %s (%d)", env.fault_string, env.fault_code);
+		return env.fault_code;
+	}
+
+	job.results = results;
+
+	long long iterations = 0;
+	long long start = now_ns();
+	long long ns;
+	do {
+		r = read_sub_infos(&job);
+		free_sub_infos(&job);
+		job.sub_infos = NULL;
+		job.n_sub_infos = 0;
+		job.sub_strings = NULL;
+		if (r != 0)
+			break;
+		iterations++;
+	} while ((ns = now_ns() - start) < BENCH_MIN_NS);
+
+	if (r == 0)
+		report("read_sub_infos", n, iterations, ns, 0);
+
+	return r;
+}
+
+/*
+ * choose_from_results() with n results, without asking, so the alignment
+ * and the table are the whole work. The table is written to a temporary
+ * file, the bytes per op are the bytes of the table.
+ */
+static int bench_choose(int n) {
+	_cleanup_free_ char *path = temp_path("table");
+	struct sub_info *sub_infos = calloc(n, sizeof(struct sub_info));
+	char **names = calloc(n, sizeof(char *));
+	int r = 0;
+
+	if (!path || !sub_infos || !names) {
+		r = log_oom();
+		goto finish;
+	}
+
+	for (int i = 0; i < n; i++) {
+		if (asprintf(&names[i], "Some.Movie.%d.%s.x264-GROUP%d", 1990 + i % 30,
+		             i % 3 ? "720p.HDTV" : "1080p.BluRay", i % 7) == -1) {
+			names[i] = NULL;
+			r = log_oom();
+			goto finish;
+		}
+		sub_infos[i].id = i + 1;
+		sub_infos[i].matched_by_hash = i % 4 == 0;
+		sub_infos[i].lang = "eng";
+		sub_infos[i].release_name = names[i];
+		sub_infos[i].filename = names[i];
+	}
+
+	if (!freopen(path, "w", stdout)) {
+		log_err("failed to open %s: %m", path);
+		r = errno;
+		goto finish;
+	}
+
+	never_ask = true;
+	always_ask = false;
+	quiet = 0;
+
+	long long iterations = 0;
+	long long start = now_ns();
+	long long ns;
+	do {
+		int sel;
+		r = choose_from_results("Some.Movie.2000.1080p.BluRay.x264-GROUP3.mkv", sub_infos, n, &sel);
+		if (r != 0)
+			break;
+		iterations++;
+	} while ((ns = now_ns() - start) < BENCH_MIN_NS);
+
+	fflush(stdout);
+	long long bytes = ftell(stdout);
+
+	if (r == 0)
+		report("choose_from_results", n, iterations, ns, bytes);
+
+finish:
+	if (path)
+		unlink(path);
+	for (int i = 0; names && i < n; i++)
+		free(names[i]);
+	free(names);
+	free(sub_infos);
+	return r;
+}
+
+int main() {
+	int r = 0;
+
+	int out_fd = dup(STDOUT_FILENO);
+	out = out_fd != -1 ? fdopen(out_fd, "w") : NULL;
+	if (!out) {
+		log_err("failed to duplicate stdout: %m");
+		return EXIT_FAILURE;
+	}
+
+	const off_t hash_sizes[] = { 64 * 1024, 1024 * 1024, 1024LL * 1024 * 1024, 16LL * 1024 * 1024 * 1024 };
+	for (size_t i = 0; r == 0 && i < sizeof(hash_sizes) / sizeof(hash_sizes[0]); i++)
+		r = bench_hash(hash_sizes[i]);
+
+	const size_t sub_sizes[] = { 10 * 1024, 100 * 1024, 1024 * 1024, 8 * 1024 * 1024 };
+	for (size_t i = 0; r == 0 && i < sizeof(sub_sizes) / sizeof(sub_sizes[0]); i++) {
+		r = bench_sub_write(sub_sizes[i], false);
+		if (r == 0)
+			r = bench_sub_write(sub_sizes[i], true);
+	}
+
+	xmlrpc_env_init(&env);
+
+	const int result_counts[] = { 10, 100, 500, 5000 };
+	for (size_t i = 0; r == 0 && i < sizeof(result_counts) / sizeof(result_counts[0]); i++)
+		r = bench_read_sub_infos(result_counts[i]);
+	for (size_t i = 0; r == 0 && i < sizeof(result_counts) / sizeof(result_counts[0]); i++)
+		r = bench_choose(result_counts[i]);
+
+	fclose(out);
+
+	return r == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,514 @@
+/*
+ * mock_server - a local stand-in for the OpenSubtitles.org XML-RPC API
+ *
+ * Implements LogIn, NoOperation, SearchSubtitles, DownloadSubtitles and
+ * GetSubLanguages with synthetic results, so subberthehut can be
+ * benchmarked and tested without the (retired) real server:
+ *
+ *   mock_server --port 8080 &
+ *   subberthehut --url http://localhost:8080/RPC2 -n movie.mkv
+ *
+ * Every query returns --results results per requested language (up to the
+ * "limit" of the call), hash-based queries return hash matches. All subtitles have the same
+ * content of --payload-size bytes. Every call is delayed by --latency ms,
+ * --slow percent of them by --slow-latency ms instead, for a long tail.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include <xmlrpc-c/base.h>
+#include <xmlrpc-c/server.h>
+#include <xmlrpc-c/server_abyss.h>
+#include <glib.h> // g_base64_encode, g_str_hash, g_strsplit, g_random_int_range
+#include <zlib.h>
+
+#define MAX_RESULTS 99
+
+// the "release" part of the generated names, so the results can be told apart
+static const char *release_tags[] = {
+	"1080p.BluRay.x264-GROUP",
+	"720p.WEB-DL.DD5.1.H264-OTHER",
+	"2160p.UHD.BluRay.x265-HDR",
+	"DVDRip.XviD-OLD",
+	"1080p.WEBRip.x265-RARBG",
+	"720p.HDTV.x264-KILLERS",
+};
+#define N_RELEASE_TAGS (sizeof(release_tags) / sizeof(release_tags[0]))
+
+static const char *languages[][2] = {
+	{"eng", "English"},
+	{"ger", "German"},
+	{"fre", "French"},
+	{"spa", "Spanish"},
+	{"dut", "Dutch"},
+};
+#define N_LANGUAGES (sizeof(languages) / sizeof(languages[0]))
+
+// options
+static unsigned int port = 8080;
+static unsigned int latency = 0; // ms
+static int slow = 0;             // percent of the calls which take slow_latency
+static unsigned int slow_latency = 2000; // ms
+static int results = 10;
+static size_t payload_size = 50 * 1024;
+
+static char token[32];
+static char *payload_base64; // the gzipped and base64 encoded subtitle
+
+static void delay() {
+	unsigned int ms = slow > 0 && g_random_int_range(0, 100) < slow ? slow_latency : latency;
+	if (ms > 0)
+		usleep(ms * 1000);
+}
+
+/*
+ * generates a subtitle of payload_size bytes and encodes it like the real
+ * server does (gzip, then base64).
+ */
+static int payload_init() {
+	char *sub = malloc(payload_size + 1);
+	uLongf gz_len = compressBound(payload_size) + 32;
+	unsigned char *gz = malloc(gz_len);
+	if (!sub || !gz) {
+		free(sub);
+		free(gz);
+		return -1;
+	}
+
+	size_t len = 0;
+	for (int i = 1; len < payload_size; i++) {
+		int n = snprintf(sub + len, payload_size + 1 - len,
+		                 "%d\n00:%02d:%02d,000 --> 00:%02d:%02d,500\nThis is line %d of the mock subtitle.\n\n",
+		                 i, i / 60 % 60, i % 60, i / 60 % 60, i % 60, i);
+		len += n < 0 ? 0 : (size_t)n;
+	}
+	len = payload_size;
+
+	z_stream strm = {0};
+	int r = deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+	if (r == Z_OK) {
+		strm.next_in = (unsigned char *)sub;
+		strm.avail_in = len;
+		strm.next_out = gz;
+		strm.avail_out = gz_len;
+		r = deflate(&strm, Z_FINISH) == Z_STREAM_END ? 0 : -1;
+		gz_len = strm.total_out;
+		deflateEnd(&strm);
+	}
+
+	if (r == 0)
+		payload_base64 = g_base64_encode(gz, gz_len);
+
+	free(sub);
+	free(gz);
+	return r;
+}
+
+static xmlrpc_value *status_response(xmlrpc_env *env, const char *status) {
+	return xmlrpc_build_value(env, "{s:s,s:d}", "status", status, "seconds", latency / 1000.0);
+}
+
+/*
+ * checks the token (the first parameter) of a call. Tokens of earlier
+ * runs of the server are rejected, like expired ones by the real server.
+ */
+static bool token_valid(xmlrpc_env *env, xmlrpc_value *params) {
+	xmlrpc_value *token_xmlval = NULL;
+	const char *t = NULL;
+	bool valid = false;
+
+	if (xmlrpc_array_size(env, params) < 1)
+		return false;
+
+	xmlrpc_array_read_item(env, params, 0, &token_xmlval);
+	xmlrpc_read_string(env, token_xmlval, &t);
+	if (!env->fault_occurred)
+		valid = strcmp(t, token) == 0;
+
+	// a missing token is reported as unauthorized, not as a fault
+	xmlrpc_env_clean(env);
+	xmlrpc_env_init(env);
+
+	if (t)
+		free((void *)t);
+	if (token_xmlval)
+		xmlrpc_DECREF(token_xmlval);
+	return valid;
+}
+
+static xmlrpc_value *log_in(xmlrpc_env *env, xmlrpc_value *params, void *server_info, void *call_info) {
+	(void)params;
+	(void)server_info;
+	(void)call_info;
+
+	delay();
+	return xmlrpc_build_value(env, "{s:s,s:s,s:d}", "status", "200 OK", "token", token, "seconds", latency / 1000.0);
+}
+
+static xmlrpc_value *no_operation(xmlrpc_env *env, xmlrpc_value *params, void *server_info, void *call_info) {
+	(void)server_info;
+	(void)call_info;
+
+	delay();
+	if (!token_valid(env, params))
+		return status_response(env, "401 Unauthorized");
+	return status_response(env, "200 OK");
+}
+
+static char *query_string(xmlrpc_env *env, xmlrpc_value *query, const char *key) {
+	xmlrpc_value *xmlval = NULL;
+	const char *str = NULL;
+
+	xmlrpc_struct_find_value(env, query, key, &xmlval);
+	if (!xmlval)
+		return NULL;
+
+	xmlrpc_read_string(env, xmlval, &str);
+	xmlrpc_DECREF(xmlval);
+	return (char *)str;
+}
+
+/*
+ * the index of lang in languages, N_LANGUAGES for any other language.
+ */
+static unsigned int language_index(const char *lang) {
+	unsigned int i = 0;
+	while (i < N_LANGUAGES && strcmp(languages[i][0], lang) != 0)
+		i++;
+	return i;
+}
+
+/*
+ * appends the results of query number q to data, --results for each of
+ * the requested languages, until data has limit results.
+ */
+static void search_query(xmlrpc_env *env, xmlrpc_value *query, int q, int limit, xmlrpc_value *data) {
+	char *hash = query_string(env, query, "moviehash");
+	char *name = query_string(env, query, "query");
+	char *langs = query_string(env, query, "sublanguageid");
+
+	// "all" gets English
+	gchar **lang_list = g_strsplit(langs && *langs && strcmp(langs, "all") != 0 ? langs : "eng", ",", -1);
+
+	// strip the extension of the file name
+	char *title = strdup(name ? name : hash ? hash : "Mock.Movie");
+	char *ext = strrchr(title, '.');
+	if (ext && ext != title)
+		*ext = '\0';
+
+	unsigned int base_id = g_str_hash(hash ? hash : name ? name : "") % 1000000;
+
+	for (gchar **lang = lang_list; *lang && !env->fault_occurred; lang++) {
+		int n = limit - xmlrpc_array_size(env, data);
+		if (n > results)
+			n = results;
+
+		for (int i = 0; i < n && !env->fault_occurred; i++) {
+			char id[16], query_number[16], sub_size[24], release[256], sub_filename[300];
+			snprintf(id, sizeof(id), "%u", (base_id * (N_LANGUAGES + 1) + language_index(*lang)) * 100 + i + 1);
+			snprintf(query_number, sizeof(query_number), "%d", q);
+			snprintf(sub_size, sizeof(sub_size), "%zu", payload_size);
+			snprintf(release, sizeof(release), "%.200s.%s", title, release_tags[i % N_RELEASE_TAGS]);
+			snprintf(sub_filename, sizeof(sub_filename), "%s.srt", release);
+
+			xmlrpc_value *result = xmlrpc_build_value(env, "{s:s,s:s,s:s,s:s,s:s,s:s,s:s,s:s}",
+			                                          "IDSubtitleFile", id,
+			                                          "MatchedBy", hash ? "moviehash" : "fulltext",
+			                                          "MovieHash", hash ? hash : "0",
+			                                          "SubLanguageID", *lang,
+			                                          "MovieReleaseName", release,
+			                                          "SubFileName", sub_filename,
+			                                          "SubSize", sub_size,
+			                                          "QueryNumber", query_number);
+			if (!env->fault_occurred) {
+				xmlrpc_array_append_item(env, data, result);
+				xmlrpc_DECREF(result);
+			}
+		}
+	}
+
+	g_strfreev(lang_list);
+	free(title);
+	free(hash);
+	free(name);
+	free(langs);
+}
+
+static xmlrpc_value *search_subtitles(xmlrpc_env *env, xmlrpc_value *params, void *server_info, void *call_info) {
+	(void)server_info;
+	(void)call_info;
+
+	xmlrpc_value *queries = NULL;
+	xmlrpc_value *options = NULL;
+	xmlrpc_value *limit_xmlval = NULL;
+	xmlrpc_value *data = NULL;
+	xmlrpc_value *response = NULL;
+	int limit = 500;
+
+	delay();
+	if (!token_valid(env, params))
+		return status_response(env, "401 Unauthorized");
+
+	xmlrpc_array_read_item(env, params, 1, &queries);
+	if (xmlrpc_array_size(env, params) > 2) {
+		xmlrpc_array_read_item(env, params, 2, &options);
+		xmlrpc_struct_find_value(env, options, "limit", &limit_xmlval);
+		if (limit_xmlval)
+			xmlrpc_read_int(env, limit_xmlval, &limit);
+	}
+
+	int n_queries = xmlrpc_array_size(env, queries);
+	data = xmlrpc_array_new(env);
+
+	// the limit applies to the whole call
+	for (int q = 0; q < n_queries && !env->fault_occurred; q++) {
+		xmlrpc_value *query = NULL;
+		xmlrpc_array_read_item(env, queries, q, &query);
+		if (!env->fault_occurred)
+			search_query(env, query, q, limit, data);
+		if (query)
+			xmlrpc_DECREF(query);
+	}
+
+	if (!env->fault_occurred)
+		response = xmlrpc_build_value(env, "{s:s,s:A,s:d}", "status", "200 OK", "data", data, "seconds", latency / 1000.0);
+
+	if (data)
+		xmlrpc_DECREF(data);
+	if (limit_xmlval)
+		xmlrpc_DECREF(limit_xmlval);
+	if (options)
+		xmlrpc_DECREF(options);
+	if (queries)
+		xmlrpc_DECREF(queries);
+	return response;
+}
+
+static xmlrpc_value *download_subtitles(xmlrpc_env *env, xmlrpc_value *params, void *server_info, void *call_info) {
+	(void)server_info;
+	(void)call_info;
+
+	xmlrpc_value *ids = NULL;
+	xmlrpc_value *data = NULL;
+	xmlrpc_value *response = NULL;
+
+	delay();
+	if (!token_valid(env, params))
+		return status_response(env, "401 Unauthorized");
+
+	xmlrpc_array_read_item(env, params, 1, &ids);
+	int n = xmlrpc_array_size(env, ids);
+	data = xmlrpc_array_new(env);
+
+	size_t payload_len = strlen(payload_base64);
+	for (int i = 0; i < n && !env->fault_occurred; i++) {
+		xmlrpc_value *id_xmlval = NULL;
+		int id = 0;
+		char id_str[16];
+
+		xmlrpc_array_read_item(env, ids, i, &id_xmlval);
+		xmlrpc_read_int(env, id_xmlval, &id);
+		if (id_xmlval)
+			xmlrpc_DECREF(id_xmlval);
+		if (env->fault_occurred)
+			break;
+
+		snprintf(id_str, sizeof(id_str), "%d", id);
+		xmlrpc_value *sub_base64 = xmlrpc_string_new_lp(env, payload_len, payload_base64);
+		xmlrpc_value *sub = xmlrpc_build_value(env, "{s:s,s:V}", "idsubtitlefile", id_str, "data", sub_base64);
+		if (!env->fault_occurred)
+			xmlrpc_array_append_item(env, data, sub);
+
+		if (sub)
+			xmlrpc_DECREF(sub);
+		if (sub_base64)
+			xmlrpc_DECREF(sub_base64);
+	}
+
+	if (!env->fault_occurred)
+		response = xmlrpc_build_value(env, "{s:s,s:A,s:d}", "status", "200 OK", "data", data, "seconds", latency / 1000.0);
+
+	if (data)
+		xmlrpc_DECREF(data);
+	if (ids)
+		xmlrpc_DECREF(ids);
+	return response;
+}
+
+static xmlrpc_value *get_sub_languages(xmlrpc_env *env, xmlrpc_value *params, void *server_info, void *call_info) {
+	(void)params;
+	(void)server_info;
+	(void)call_info;
+
+	xmlrpc_value *data = xmlrpc_array_new(env);
+	xmlrpc_value *response = NULL;
+
+	delay();
+	for (size_t i = 0; i < N_LANGUAGES && !env->fault_occurred; i++) {
+		xmlrpc_value *language = xmlrpc_build_value(env, "{s:s,s:s,s:s}",
+		                                            "SubLanguageID", languages[i][0],
+		                                            "LanguageName", languages[i][1],
+		                                            "ISO639", "xx");
+		if (!env->fault_occurred) {
+			xmlrpc_array_append_item(env, data, language);
+			xmlrpc_DECREF(language);
+		}
+	}
+
+	if (!env->fault_occurred)
+		response = xmlrpc_build_value(env, "{s:s,s:A}", "status", "200 OK", "data", data);
+
+	xmlrpc_DECREF(data);
+	return response;
+}
+
+static void show_usage() {
+	puts("Usage: mock_server [options]\n\n"
+
+	     "Local stand-in for the OpenSubtitles.org XML-RPC API, serving /RPC2.\n\n"
+
+	     "Options:\n"
+	     " -h, --help                  Show this help and exit.\n"
+	     " -p, --port <port>           The port to listen on. The default is 8080.\n"
+	     " -l, --latency <ms>          Delay every call by <ms>. The default is 0.\n"
+	     " -S, --slow <percent>        Delay <percent> of the calls by --slow-latency\n"
+	     "                             instead. The default is 0.\n"
+	     " -L, --slow-latency <ms>     The delay of slow calls. The default is 2000.\n"
+	     " -r, --results <number>      Results per query, at most 99. The default is 10.\n"
+	     " -s, --payload-size <bytes>  The size of every subtitle. The default is 51200.\n");
+}
+
+static bool parse_number(const char *str, long min, long max, long *n) {
+	char *endptr = NULL;
+	*n = strtol(str, &endptr, 10);
+	return *str != '\0' && *endptr == '\0' && *n >= min && *n <= max;
+}
+
+int main(int argc, char *argv[]) {
+	const struct option opts[] = {
+		{"help", no_argument, NULL, 'h'},
+		{"port", required_argument, NULL, 'p'},
+		{"latency", required_argument, NULL, 'l'},
+		{"slow", required_argument, NULL, 'S'},
+		{"slow-latency", required_argument, NULL, 'L'},
+		{"results", required_argument, NULL, 'r'},
+		{"payload-size", required_argument, NULL, 's'},
+		{0, 0, 0, 0}
+	};
+
+	int c;
+	long n;
+	while ((c = getopt_long(argc, argv, "hp:l:S:L:r:s:", opts, NULL)) != -1) {
+		switch (c) {
+		case 'h':
+			show_usage();
+			return EXIT_SUCCESS;
+
+		case 'p':
+			if (!parse_number(optarg, 1, 65535, &n)) {
+				fprintf(stderr, "invalid port: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			port = n;
+			break;
+
+		case 'l':
+			if (!parse_number(optarg, 0, 3600 * 1000, &n)) {
+				fprintf(stderr, "invalid latency: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			latency = n;
+			break;
+
+		case 'S':
+			if (!parse_number(optarg, 0, 100, &n)) {
+				fprintf(stderr, "invalid share of slow calls: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			slow = n;
+			break;
+
+		case 'L':
+			if (!parse_number(optarg, 0, 3600 * 1000, &n)) {
+				fprintf(stderr, "invalid slow latency: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			slow_latency = n;
+			break;
+
+		case 'r':
+			if (!parse_number(optarg, 0, MAX_RESULTS, &n)) {
+				fprintf(stderr, "invalid number of results: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			results = n;
+			break;
+
+		case 's':
+			if (!parse_number(optarg, 1, 64 * 1024 * 1024, &n)) {
+				fprintf(stderr, "invalid payload size: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			payload_size = n;
+			break;
+
+		default:
+			return EXIT_FAILURE;
+		}
+	}
+
+	// a new token for every run, so cached tokens of earlier runs expire
+	snprintf(token, sizeof(token), "mock%ld", (long)getpid());
+
+	if (payload_init() != 0) {
+		fprintf(stderr, "failed to generate the subtitle.\n");
+		return EXIT_FAILURE;
+	}
+
+	xmlrpc_env env;
+	xmlrpc_env_init(&env);
+	xmlrpc_limit_set(XMLRPC_XML_SIZE_LIMIT_ID, 64 * 1024 * 1024);
+
+	xmlrpc_registry *registry = xmlrpc_registry_new(&env);
+	const struct xmlrpc_method_info3 methods[] = {
+		{ .methodName = "LogIn", .methodFunction = log_in },
+		{ .methodName = "NoOperation", .methodFunction = no_operation },
+		{ .methodName = "SearchSubtitles", .methodFunction = search_subtitles },
+		{ .methodName = "DownloadSubtitles", .methodFunction = download_subtitles },
+		{ .methodName = "GetSubLanguages", .methodFunction = get_sub_languages },
+	};
+	for (size_t i = 0; i < sizeof(methods) / sizeof(methods[0]) && !env.fault_occurred; i++)
+		xmlrpc_registry_add_method3(&env, registry, &methods[i]);
+
+	xmlrpc_server_abyss_parms parms = {
+		.config_file_name = NULL,
+		.registryP = registry,
+		.port_number = port,
+		.log_file_name = NULL,
+		.keepalive_timeout = 60,
+		.keepalive_max_conn = 10000,
+	};
+
+	if (!env.fault_occurred) {
+		fprintf(stderr, "listening on http://localhost:%u/RPC2\n", port);
+		xmlrpc_server_abyss(&env, &parms, XMLRPC_APSIZE(keepalive_max_conn));
+	}
+
+	int r = EXIT_SUCCESS;
+	if (env.fault_occurred) {
+		fprintf(stderr, "server failed: %s (%d)\n", env.fault_string, env.fault_code);
+		r = EXIT_FAILURE;
+	}
+
+	if (registry)
+		xmlrpc_registry_free(registry);
+	xmlrpc_env_clean(&env);
+	g_free(payload_base64);
+
+	return r;
+}
@@ -25,10 +25,24 @@
 #include <errno.h>
 #include <stdbool.h>
 #include <inttypes.h> // uint64_t / PRIx64
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/xattr.h>
+#include <dirent.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h> // SYS_gettid
+#include <sys/ioctl.h>
+#include <linux/fs.h> // FICLONE
 
 #include <xmlrpc-c/base.h>
 #include <xmlrpc-c/client.h>
-#include <glib.h> // g_base64_decode_step
+#include <glib.h> // g_base64_decode_step, GThreadPool
 #include <zlib.h>
 
 #define STH_XMLRPC_URL         "https://api.opensubtitles.org/xml-rpc"
@@ -36,9 +50,52 @@
 #define LOGIN_USER_AGENT       "subberthehut v" VERSION
 
 #define ZLIB_CHUNK             (64 * 1024)
+// base64 characters which decode to at most ZLIB_CHUNK bytes (3 bytes per 4 characters, plus a pending quad)
+#define B64_CHUNK              ((ZLIB_CHUNK - 3) / 3 * 4)
+#define HASH_CHUNK             (64 * 1024)
+
+#define HASH_CACHE_MAGIC       UINT64_C(0x3168636874737573) // "susthch1"
+#define HASH_CACHE_SLOTS       (64 * 1024) // at first, see hash_cache_grow()
+#define HASH_CACHE_PROBES      8
+#define HASH_CACHE_XATTR_NAME  "user.subberthehut.hash"
+
+#define SCAN_THREADS           8
+
+#define MAX_PROVIDERS          8
+
+#define SUB_STRINGS_PER_RESULT 128 // bytes, the initial arena size of search results
+
+#define STORE_CHECKSUM_LEN     64 // hex SHA-256 of a blob
+
+#define SEARCH_LIMIT_MAX       500 // the server returns at most this many results per call
 
 #define STH_XMLRPC_SIZE_LIMIT  (10 * 1024 * 1024)
 
+// keep DownloadSubtitles responses well below STH_XMLRPC_SIZE_LIMIT
+#define DOWNLOAD_SIZE_LIMIT    (STH_XMLRPC_SIZE_LIMIT / 2)
+#define DOWNLOAD_SIZE_UNKNOWN  (256 * 1024)
+
+#define RPC_POLL_INTERVAL      10 // ms
+#define RPC_CONNECT_TIMEOUT    (15 * 1000) // ms
+#define RPC_TIMEOUT            (120 * 1000) // ms, for the whole request
+
+// failed requests are retried after 1 s, 2 s, 4 s, ... (at most 30 s), with jitter
+#define RETRY_BASE_DELAY       (1 * G_USEC_PER_SEC)
+#define RETRY_MAX_DELAY        (30 * G_USEC_PER_SEC)
+#define RETRIES_MAX            100
+
+// --hedge: the latencies of the last searches of a provider which are kept
+#define HEDGE_SAMPLES          100
+#define HEDGE_MIN_SAMPLES      10 // no duplicates before that many searches
+
+// --watch: wait until nothing was written to a new file for this long
+#define WATCH_DEBOUNCE         (2 * G_USEC_PER_SEC)
+// ... and keep the session alive while idle
+#define WATCH_KEEPALIVE        (10 * 60) // s
+
+// the server invalidates a session token after 15 minutes without a request
+#define TOKEN_IDLE_TIMEOUT     (14 * 60) // s
+
 #define HEADER_ID              '#'
 #define HEADER_MATCHED_BY_HASH 'H'
 #define HEADER_LANG            "Lng"
@@ -52,7 +109,12 @@
 /* __attribute__(cleanup) */
 #define _cleanup_free_    __attribute__((cleanup(cleanup_free)))
 #define _cleanup_fclose_  __attribute__((cleanup(cleanup_fclose)))
+#define _cleanup_close_   __attribute__((cleanup(cleanup_close)))
 #define _cleanup_xmlrpc_  __attribute__((cleanup(cleanup_xmlrpc_DECREF)))
+#define _cleanup_rpc_     __attribute__((cleanup(rpc_clean)))
+
+struct rpc;
+static void rpc_clean(struct rpc *rpc);
 
 static void cleanup_free(void *p) {
 	free(*(void**)p);
@@ -63,6 +125,11 @@ static void cleanup_fclose(FILE **p) {
 		fclose(*p);
 }
 
+static void cleanup_close(int *p) {
+	if (*p != -1)
+		close(*p);
+}
+
 static void cleanup_xmlrpc_DECREF(xmlrpc_value **p) {
 	if(*p)
 		xmlrpc_DECREF(*p);
@@ -71,8 +138,180 @@ static void cleanup_xmlrpc_DECREF(xmlrpc_value **p) {
 
 static xmlrpc_env env;
 static xmlrpc_client *client;
+static int rpcs_in_flight = 0;
+static int rpcs_sent = 0;       // requests, including duplicates
+static int rpcs_hedged = 0;     // duplicates, see --hedge
+static int rpcs_hedge_won = 0;  // duplicates whose response was used
+static double rate_tokens;      // requests which may be sent right now
+static gint64 rate_updated;     // monotonic time rate_tokens was updated
+static GPtrArray *rpcs_started; // the rpcs rpc_finish_all() has to wait for
+
+static GThreadPool *hash_pool;
+static GMutex hash_mutex;
+static GCond hash_cond;
+
+enum hash_cache_type {
+	HASH_CACHE_NONE,
+	HASH_CACHE_FILE,
+	HASH_CACHE_XATTR,
+};
+
+struct hash_cache_entry {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint64_t hash;
+	uint64_t check; // hash_cache_entry_check()
+};
+
+struct hash_cache_header {
+	uint64_t magic;
+	uint64_t n_slots;
+};
+
+struct hash_cache_file {
+	struct hash_cache_header header;
+	struct hash_cache_entry entries[]; // header.n_slots
+};
+
+static struct hash_cache_file *hash_cache_map;
+static uint64_t hash_cache_slots; // of hash_cache_map
+static char *hash_cache_path;
+static GMutex hash_cache_mutex;
+
+struct scan;
+
+struct file_source {
+	char **args;       // files from the command line
+	int n_args;
+	FILE *list;        // --files-from
+	char delim;
+	struct scan *scan; // the directory being scanned with --recursive
+	GPtrArray *found;  // videos which are already known (--watch)
+	guint found_next;  // the next one to return
+};
+
+/*
+ * a directory of a scan. Its entries are read by a scan thread and
+ * returned by scan_next() in order, while the scan threads already read
+ * the subdirectories further down.
+ */
+struct scan_dir {
+	struct scan_dir *parent;
+	char *name;             // relative to the parent
+	char *path;
+	int fd;                 // kept open while subdirectories are opened relative to it
+	int refs;               // the subdirectories which haven't been opened yet
+	bool read;              // the entries are known
+	GArray *entries;        // struct scan_entry, in order
+	guint next;             // the next entry to return
+};
+
+struct scan_entry {
+	char *path;             // a video without subtitle
+	struct scan_dir *dir;   // or a subdirectory
+};
+
+struct scan {
+	GThreadPool *pool;
+	GMutex mutex;
+	GCond read;             // some directory has been read
+	GPtrArray *stack;       // the directories being returned, innermost last
+	bool stopped;
+	char *root;
+	unsigned found;
+};
+
+static const char *video_extensions[] = {
+	"3gp", "asf", "avi", "divx", "flv", "m2ts", "m4v", "mkv", "mov", "mp4",
+	"mpeg", "mpg", "mts", "ogm", "ogv", "rm", "rmvb", "ts", "vob", "webm", "wmv",
+	NULL
+};
+
+static const char *subtitle_extensions[] = {
+	"srt", "sub", "ass", "ssa", "smi", "txt", "vtt", NULL
+};
+
+/*
+ * the tags of release names which are compared by --auto-select,
+ * with the different spellings of the same thing mapped to one.
+ */
+struct tag {
+	const char *name;
+	const char *canonical;
+};
+
+static const struct tag resolution_tags[] = {
+	{"2160p", "2160p"}, {"4k", "2160p"}, {"uhd", "2160p"},
+	{"1080p", "1080p"}, {"1080i", "1080p"},
+	{"720p", "720p"}, {"576p", "576p"}, {"480p", "480p"},
+	{NULL, NULL}
+};
+
+static const struct tag source_tags[] = {
+	{"bluray", "bluray"}, {"bdrip", "bluray"}, {"brrip", "bluray"}, {"bdremux", "bluray"},
+	{"webdl", "web"}, {"webrip", "web"}, {"web", "web"},
+	{"hdtv", "hdtv"}, {"pdtv", "hdtv"}, {"hdrip", "hdrip"},
+	{"dvdrip", "dvd"}, {"dvd", "dvd"}, {"dvdscr", "dvd"},
+	{NULL, NULL}
+};
+
+static const struct tag codec_tags[] = {
+	{"x264", "h264"}, {"h264", "h264"}, {"avc", "h264"},
+	{"x265", "h265"}, {"h265", "h265"}, {"hevc", "h265"},
+	{"xvid", "xvid"}, {"divx", "xvid"},
+	{NULL, NULL}
+};
+
+/*
+ * the other codes of languages accepted by -l, mapped to the SubLanguageID
+ * the server uses: ISO 639-1 and the ISO 639-2/T codes which differ.
+ */
+static const struct tag lang_tags[] = {
+	{"en", "eng"}, {"de", "ger"}, {"deu", "ger"}, {"fr", "fre"}, {"fra", "fre"},
+	{"es", "spa"}, {"it", "ita"}, {"nl", "dut"}, {"nld", "dut"}, {"pt", "por"},
+	{"pb", "pob"}, {"ru", "rus"}, {"pl", "pol"}, {"cs", "cze"}, {"ces", "cze"},
+	{"sk", "slo"}, {"slk", "slo"}, {"hu", "hun"}, {"ro", "rum"}, {"ron", "rum"},
+	{"el", "gre"}, {"ell", "gre"}, {"tr", "tur"}, {"ar", "ara"}, {"he", "heb"},
+	{"zh", "chi"}, {"zho", "chi"}, {"ja", "jpn"}, {"ko", "kor"}, {"sv", "swe"},
+	{"no", "nor"}, {"da", "dan"}, {"fi", "fin"}, {"is", "ice"}, {"isl", "ice"},
+	{"bg", "bul"}, {"hr", "hrv"}, {"sr", "scc"}, {"srp", "scc"}, {"sl", "slv"},
+	{"uk", "ukr"}, {"vi", "vie"}, {"th", "tha"}, {"id", "ind"}, {"fa", "per"},
+	{"fas", "per"}, {"sq", "alb"}, {"sqi", "alb"}, {"mk", "mac"}, {"mkd", "mac"},
+	{"ms", "may"}, {"msa", "may"}, {"et", "est"}, {"lv", "lav"}, {"lt", "lit"},
+	{"ca", "cat"}, {"eu", "baq"}, {"eus", "baq"}, {"ka", "geo"}, {"kat", "geo"},
+	{"hy", "arm"}, {"hye", "arm"}, {"bs", "bos"}, {"hi", "hin"},
+	{NULL, NULL}
+};
+
+#define RELEASE_MAX_TOKENS     64
+
+struct release {
+	char *buf;                 // the lowercase tokens of the name
+	const char *words[RELEASE_MAX_TOKENS]; // the title, before the first tag
+	int n_words;
+	int season;
+	int episode;               // 0 if there is no episode marker
+	int year;                  // 0 if there is none
+	const char *resolution;    // canonical tags, NULL if there are none
+	const char *source;
+	const char *codec;
+	const char *group;         // the release group, NULL if there is none
+};
+
+struct search_cache_entry {
+	time_t mtime;
+	char name[64];
+};
+
+static char *search_cache_dir;
+static char *search_cache_langs;
 
 // options default values
+static const char *urls[MAX_PROVIDERS]; // --url, STH_XMLRPC_URL if none
+static int n_urls = 0;
 static const char *lang = "eng";
 static bool list_languages = false;
 static bool force_overwrite = false;
@@ -82,27 +321,198 @@ static bool hash_search_only = false;
 static bool name_search_only = false;
 static bool same_name = false;
 static int limit = 10;
+static int batch_size = 1;
+static int max_jobs = 1;
+static int hash_threads = 4;
+static enum hash_cache_type hash_cache = HASH_CACHE_NONE;
+static long search_cache_ttl = 0; // s, 0 disables the search cache
+static int search_cache_size = 10000;
+static long hash_cache_size = 1024 * 1024; // entries
+static bool recursive = false;
+static const char *files_from = NULL;
+static bool null_delimited = false;
+static bool watch = false;
+static FILE *prompt_input = NULL;
 static bool exit_on_fail = true;
+static int auto_select = 0; // percent, 0 = off
+static bool per_language = false;
+static int n_langs = 1;    // the languages of -l, 1 for "all"
 static unsigned int quiet = 0;
+static const char *trace_path = NULL;
+static bool stats = false;
+static bool json = false;
+static int rate_requests = 40; // the limit of the server: 40 requests per 10 seconds
+static int rate_window = 10;   // s
+static int max_retries = 3;
+static int hedge_percentile = 0; // 0 = off
+static int hedge_budget = 5;     // percent of all requests
+static const char *store_dir = NULL;
+
+// options without a short version
+enum {
+	OPT_SEARCH_CACHE_TTL = 0x100,
+	OPT_SEARCH_CACHE_SIZE,
+	OPT_HASH_CACHE_SIZE,
+	OPT_URL,
+	OPT_TRACE,
+	OPT_STATS,
+	OPT_RATE,
+	OPT_RETRIES,
+	OPT_JSON,
+	OPT_AUTO_SELECT,
+	OPT_PER_LANGUAGE,
+	OPT_STORE,
+	OPT_HEDGE,
+	OPT_HEDGE_BUDGET,
+};
 
+/*
+ * the strings of a search result are kept in the sub_strings arena of its job
+ * (the languages interned), so thousands of results are freed at once.
+ */
 struct sub_info {
-	int id;
-	bool matched_by_hash;
 	const char *lang;
 	const char *release_name;
 	const char *filename;
+	long size; // uncompressed size in bytes, 0 if unknown
+	int id;
+	int score; // similarity to the video in percent (--auto-select), -1 if not ranked
+	bool matched_by_hash;
+};
+
+struct selection {
+	int sub_id;
+	long sub_size;         // SubSize of the subtitle
+	const char *lang;      // owned by sub_infos of the job
+	const char *sub_filename; // SubFileName of the subtitle, owned by sub_infos of the job
+	const char *sub_filepath;
+	bool matched_by_hash;  // only those are added to the store
+	bool downloaded;
+};
+
+// the phases of processing a file, for --trace, --stats and --json
+enum phase {
+	PHASE_HASH,
+	PHASE_LOGIN,
+	PHASE_SEARCH,
+	PHASE_DOWNLOAD,
+	PHASE_DECODE,
+	N_PHASES
+};
+
+static const char *phase_names[N_PHASES] = {
+	"hash",
+	"login",
+	"search",
+	"download",
+	"decode",
+};
+
+struct file_job {
+	const char *filepath;
+	const char *filename;
+	uint64_t hash;
+	uint64_t filesize;
+	xmlrpc_value *results; // the search results belonging to this file
+	struct sub_info *sub_infos; // the fields of the results which are used
+	int n_sub_infos;
+	GStringChunk *sub_strings; // the strings of sub_infos
+	bool hashed;           // set by the hashing thread
+	bool search_cached;    // the results were taken from the search cache
+	bool stored;           // the subtitles were taken from the store, nothing to search
+	struct provider *provider; // the provider of the results and the selections
+	struct selection *selections; // the subtitles to download, one per language with --per-language
+	int n_selections;
+	const char *status;    // for --json, if not implied by r
+	bool done;             // nothing left to do, even if r is 0
+	gint64 timings[N_PHASES]; // µs spent in each phase, for --json
+	int r;                 // non-zero once processing this file failed
+};
+
+struct provider;
+struct rpc_call;
+
+struct rpc {
+	struct provider *provider;
+	const char *method;
+	bool with_token;
+	bool relogged_in;
+	int retries;
+	gint64 retry_at;       // monotonic time (µs) of the next retry, 0 if none is due
+	xmlrpc_value *params;
+	xmlrpc_value *result;
+	int fault_code;
+	char *fault_string;
+	gint64 started;        // monotonic time (µs) the request was sent
+	gint64 finished;       // ... and the response was received
+	gint64 first_started;  // monotonic time (µs) the first attempt was sent, for --trace
+	size_t bytes;          // the size of the responses (as XML) of all attempts, for --trace
+	struct rpc_call *call; // the request in flight, NULL once it's answered
+	bool hedgeable;        // a duplicate may be sent if the response is late (--hedge)
+	gint64 hedge_at;       // monotonic time (µs) the duplicate is due, 0 if none
+	struct rpc_call *hedge_call; // the duplicate in flight
+	bool abandoned;        // the response isn't needed anymore
+	void (*complete)(struct rpc *rpc, void *data); // called once the rpc is answered for good
+	void *complete_data;
+};
+
+/*
+ * the search of a batch on one provider. With several providers, every
+ * batch is searched on all of them at once.
+ */
+struct search {
+	struct provider *provider;
+	struct batch *batch;
+	struct file_job **query_jobs; // the job each search query belongs to
+	int n_queries;
+	int call_limit;               // the "limit" of the call
+	int n_starved;                // jobs without results in a full response
+	xmlrpc_value **results;       // the results of every job of the batch
+	bool *hash_matched;           // ... and if there is a hash match among them
+	GHashTable **lang_counts;     // ... and their number per SubLanguageID (--per-language)
+	struct rpc rpc;
+	bool done;                    // answered, failed or abandoned
+	int r;
+};
+
+struct batch {
+	struct file_job *jobs;
+	int n;
+	int n_searched;               // the first jobs which are searched
+	struct search *searches;      // one per provider
+	struct rpc *download_rpcs;
+	int n_download_rpcs;
+};
+
+/*
+ * a server with the XML-RPC API of OpenSubtitles.org, see --url.
+ */
+struct provider {
+	const char *url;
+	xmlrpc_server_info *server;
+	const char *token;     // the session token
+	gint64 logged_in;      // monotonic time (µs) the token was acquired
+	int login_r;           // non-zero once logging in failed
+	gint64 latencies[HEDGE_SAMPLES]; // of the last searches (µs), a ring
+	int n_latencies;       // searches recorded so far
 };
 
+static struct provider providers[MAX_PROVIDERS]; // in the order of preference
+static int n_providers = 0;
+
 static void log_err(const char *format, ...) {
 	va_list args;
 	va_start(args, format);
+	// the scan threads log warnings, don't let their lines get mixed up
+	flockfile(stderr);
 	vfprintf(stderr, format, args);
-	va_end(args);
 	putc('\n', stderr);
+	funlockfile(stderr);
+	va_end(args);
 }
 
 static void log_info(const char *format, ...) {
-	if (quiet >= 2)
+	if (quiet >= 2 || json)
 		return;
 
 	va_list args;
@@ -118,174 +528,1981 @@ static int log_oom() {
 }
 
 /*
- * creates the 64-bit hash used for the search query.
- * copied and modified from:
- * http://trac.opensubtitles.org/projects/opensubtitles/wiki/HashSourceCodes
+ * writes s as a JSON string (with quotes) to f. Bytes which aren't valid
+ * UTF-8, e.g. of a file name in another encoding, are replaced by U+FFFD.
  */
-static void get_hash_and_filesize(FILE *handle, uint64_t *hash, uint64_t *filesize) {
-	fseek(handle, 0, SEEK_END);
-	*filesize = ftell(handle);
-	fseek(handle, 0, SEEK_SET);
+static void json_write_string(FILE *f, const char *s) {
+	putc('"', f);
+	while (*s) {
+		const char *end;
+		g_utf8_validate(s, -1, &end);
+
+		for (; s < end; s++) {
+			unsigned char c = *s;
+			if (c == '"' || c == '\\')
+				fprintf(f, "\\%c", c);
+			else if (c < 0x20)
+				fprintf(f, "\\u%04x", c);
+			else
+				putc(c, f);
+		}
 
-	*hash = *filesize;
+		if (*s) {
+			fputs("\\ufffd", f);
+			s++;
+		}
+	}
+	putc('"', f);
+}
+
+/*
+ * --trace/--stats: a span is recorded for every phase of every file.
+ * The spans are written as Chrome trace events (chrome://tracing, Perfetto)
+ * and/or summarized as percentiles at exit. Without these options,
+ * recording a span is a single branch.
+ */
+struct span {
+	enum phase phase;
+	gint64 start;        // monotonic time in µs
+	gint64 end;
+	long tid;
+	char *file;          // may be NULL
+	size_t bytes;        // read, transferred or decoded
+};
 
-	for (uint64_t tmp = 0, i = 0; i < 65536 / sizeof(tmp) && fread((char *) &tmp, sizeof(tmp), 1, handle); *hash += tmp, i++);
-	fseek(handle, (*filesize - 65536) > 0 ? (*filesize - 65536) : 0, SEEK_SET);
-	for (uint64_t tmp = 0, i = 0; i < 65536 / sizeof(tmp) && fread((char *) &tmp, sizeof(tmp), 1, handle); *hash += tmp, i++);
+static bool tracing = false; // record spans
+static bool timing = false;  // take the time, for spans and --json
+static gint64 trace_origin;
+static GArray *spans;
+static GMutex spans_mutex;
+
+static gint64 trace_now() {
+	return timing ? g_get_monotonic_time() : 0;
 }
 
 /*
- * convenience function the get a string value from a xmlrpc struct.
+ * records a span. Called by the hashing threads, too.
  */
-static const char *struct_get_string(xmlrpc_value *s, const char *key) {
-	_cleanup_xmlrpc_ xmlrpc_value *xmlval = NULL;
-	const char *str;
+static void trace_span(enum phase phase, gint64 start, gint64 end, const char *file, size_t bytes) {
+	if (!tracing || start == 0 || end == 0)
+		return;
 
-	xmlrpc_struct_find_value(&env, s, key, &xmlval);
-	xmlrpc_read_string(&env, xmlval, &str);
+	struct span span = {
+		.phase = phase,
+		.start = start,
+		.end = end,
+		.tid = syscall(SYS_gettid),
+		.file = file ? strdup(file) : NULL,
+		.bytes = bytes,
+	};
 
-	return str;
+	g_mutex_lock(&spans_mutex);
+	if (!spans)
+		spans = g_array_new(FALSE, FALSE, sizeof(struct span));
+	g_array_append_val(spans, span);
+	g_mutex_unlock(&spans_mutex);
 }
 
-static int login(const char **token) {
-	_cleanup_xmlrpc_ xmlrpc_value *result = NULL;
-	_cleanup_xmlrpc_ xmlrpc_value *token_xmlval = NULL;
-	_cleanup_free_ const char *status = NULL;
+static void trace_end(enum phase phase, gint64 start, const char *file, size_t bytes) {
+	if (tracing)
+		trace_span(phase, start, g_get_monotonic_time(), file, bytes);
+}
 
-	xmlrpc_client_call2f(&env, client, STH_XMLRPC_URL, "LogIn", &result, "(ssss)", "", "", LOGIN_LANGCODE, LOGIN_USER_AGENT);
-	if (env.fault_occurred) {
-		log_err("login failed: %s (%d)", env.fault_string, env.fault_code);
-		return env.fault_code;
+/*
+ * records a span of a file, its duration is also kept in the job for --json.
+ */
+static void trace_job(struct file_job *job, enum phase phase, gint64 start, gint64 end, size_t bytes) {
+	if (!timing || start == 0 || end == 0)
+		return;
+
+	job->timings[phase] += end - start;
+	trace_span(phase, start, end, job->filename, bytes);
+}
+
+static void trace_write() {
+	_cleanup_fclose_ FILE *f = fopen(trace_path, "we");
+	if (!f) {
+		log_err("failed to open trace file %s: %m", trace_path);
+		return;
 	}
 
-	status = struct_get_string(result, "status");
-	if (strcmp(status, "200 OK")) {
-		log_err("login failed: %s", status);
-		return 1;
+	fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", f);
+	for (guint i = 0; spans && i < spans->len; i++) {
+		const struct span *span = &g_array_index(spans, struct span, i);
+
+		fprintf(f, "{\"name\":\"%s\",\"cat\":\"subberthehut\",\"ph\":\"X\","
+		        "\"ts\":%" G_GINT64_FORMAT ",\"dur\":%" G_GINT64_FORMAT ",\"pid\":%d,\"tid\":%ld,"
+		        "\"args\":{\"bytes\":%zu",
+		        phase_names[span->phase], span->start - trace_origin, span->end - span->start,
+		        (int)getpid(), span->tid, span->bytes);
+		if (span->file) {
+			fputs(",\"file\":", f);
+			json_write_string(f, span->file);
+		}
+		fputs(i + 1 < spans->len ? "}},\n" : "}}\n", f);
 	}
+	fputs("]}\n", f);
 
-	xmlrpc_struct_find_value(&env, result, "token", &token_xmlval);
-	xmlrpc_read_string(&env, token_xmlval, token);
+	if (fflush(f) != 0)
+		log_err("failed to write trace file %s: %m", trace_path);
+}
 
-	return 0;
+static int compare_durations(const void *a, const void *b) {
+	gint64 x = *(const gint64 *)a;
+	gint64 y = *(const gint64 *)b;
+	return x < y ? -1 : x > y;
 }
 
-static int search_get_results(const char *token, uint64_t hash, uint64_t filesize,
-                              const char *filename, xmlrpc_value **data) {
-	_cleanup_xmlrpc_ xmlrpc_value *hash_query = NULL;
-	_cleanup_xmlrpc_ xmlrpc_value *sublanguageid_xmlval = NULL;
-	_cleanup_xmlrpc_ xmlrpc_value *hash_xmlval = NULL;
-	_cleanup_xmlrpc_ xmlrpc_value *filesize_xmlval = NULL;
-	_cleanup_free_ char *hash_str = NULL;
-	_cleanup_free_ char *filesize_str = NULL;
+/*
+ * the value below which p percent of the n sorted durations are (nearest rank).
+ */
+static gint64 percentile(const gint64 *durations, int n, int p) {
+	int rank = (n * p + 99) / 100;
+	return durations[rank > 0 ? rank - 1 : 0];
+}
 
-	_cleanup_xmlrpc_ xmlrpc_value *name_query = NULL;
-	_cleanup_xmlrpc_ xmlrpc_value *filename_xmlval = NULL;
+static double percentile_ms(const gint64 *durations, int n, int p) {
+	return percentile(durations, n, p) / 1000.0;
+}
 
-	_cleanup_xmlrpc_ xmlrpc_value *query_array = NULL;
+static void stats_print() {
+	fprintf(stderr, "%-10s %8s %10s %10s %10s %10s %12s\n",
+	        "phase", "count", "p50 (ms)", "p95 (ms)", "p99 (ms)", "max (ms)", "bytes");
+
+	for (int phase = 0; phase < N_PHASES; phase++) {
+		_cleanup_free_ gint64 *durations = calloc(spans ? spans->len : 0, sizeof(gint64));
+		int n = 0;
+		size_t bytes = 0;
+
+		for (guint i = 0; spans && durations && i < spans->len; i++) {
+			const struct span *span = &g_array_index(spans, struct span, i);
+			if (span->phase != (enum phase)phase)
+				continue;
+			durations[n++] = span->end - span->start;
+			bytes += span->bytes;
+		}
 
-	_cleanup_xmlrpc_ xmlrpc_value *limit_xmlval = NULL;
-	_cleanup_xmlrpc_ xmlrpc_value *param_struct = NULL;
+		if (n == 0)
+			continue;
 
-	_cleanup_xmlrpc_ xmlrpc_value *result = NULL;
+		qsort(durations, n, sizeof(gint64), compare_durations);
+		fprintf(stderr, "%-10s %8d %10.2f %10.2f %10.2f %10.2f %12zu\n",
+		        phase_names[phase], n,
+		        percentile_ms(durations, n, 50), percentile_ms(durations, n, 95),
+		        percentile_ms(durations, n, 99), durations[n - 1] / 1000.0, bytes);
+	}
 
-	query_array = xmlrpc_array_new(&env);
+	if (hedge_percentile > 0)
+		fprintf(stderr, "hedged %d of %d requests, %d of them used\n",
+		        rpcs_hedged, rpcs_sent, rpcs_hedge_won);
+}
 
-	// create hash-based query
-	if (!name_search_only) {
-		hash_query = xmlrpc_struct_new(&env);
-		sublanguageid_xmlval = xmlrpc_string_new(&env, lang);
-		xmlrpc_struct_set_value(&env, hash_query, "sublanguageid", sublanguageid_xmlval);
-		int r = asprintf(&hash_str, "%016" PRIx64, hash);
-		if (r == -1)
-			return log_oom();
+static void trace_free() {
+	for (guint i = 0; spans && i < spans->len; i++)
+		free(g_array_index(spans, struct span, i).file);
+	if (spans)
+		g_array_free(spans, TRUE);
+	spans = NULL;
+}
 
-		hash_xmlval = xmlrpc_string_new(&env, hash_str);
-		xmlrpc_struct_set_value(&env, hash_query, "moviehash", hash_xmlval);
+/*
+ * reads up to len bytes at offset, retrying on short reads.
+ * Returns the number of bytes read or -1 on error.
+ */
+static ssize_t pread_full(int fd, void *buf, size_t len, off_t offset) {
+	size_t total = 0;
+
+	while (total < len) {
+		ssize_t n = pread(fd, (char *)buf + total, len - total, offset + total);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (n == 0)
+			break;
+		total += n;
+	}
 
-		r = asprintf(&filesize_str, "%" PRIu64, filesize);
-		if (r == -1)
-			return log_oom();
+	return total;
+}
 
-		filesize_xmlval = xmlrpc_string_new(&env, filesize_str);
-		xmlrpc_struct_set_value(&env, hash_query, "moviebytesize", filesize_xmlval);
+/*
+ * kept as a plain loop over aligned words so the compiler can vectorize it.
+ */
+static uint64_t sum_words(const uint64_t *words, size_t n) {
+	uint64_t sum = 0;
+	for (size_t i = 0; i < n; i++)
+		sum += words[i];
+	return sum;
+}
 
-		xmlrpc_array_append_item(&env, query_array, hash_query);
+/*
+ * creates the 64-bit hash used for the search query: the file size plus
+ * the sum of the first and the last 64 KiB as 64-bit words.
+ * based on:
+ * http://trac.opensubtitles.org/projects/opensubtitles/wiki/HashSourceCodes
+ *
+ * The previous stdio-based implementation never read the tail of files
+ * smaller than 64 KiB (its seek offset underflowed), and ignored a trailing
+ * partial word. Both are kept so existing hashes don't change.
+ */
+static int get_hash_and_filesize(int fd, uint64_t *hash, uint64_t *filesize) {
+	uint64_t words[HASH_CHUNK / sizeof(uint64_t)];
+	struct stat st;
+
+	if (fstat(fd, &st) == -1)
+		return errno;
+
+	*filesize = st.st_size;
+	*hash = *filesize;
+
+	// only the head and the tail are read, there is no point in readahead
+	posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+
+	ssize_t n = pread_full(fd, words, HASH_CHUNK, 0);
+	if (n == -1)
+		return errno;
+	*hash += sum_words(words, n / sizeof(uint64_t));
+
+	if (*filesize >= HASH_CHUNK) {
+		n = pread_full(fd, words, HASH_CHUNK, *filesize - HASH_CHUNK);
+		if (n == -1)
+			return errno;
+		*hash += sum_words(words, n / sizeof(uint64_t));
 	}
 
-	// create full-text query
-	if (!hash_search_only) {
-		name_query = xmlrpc_struct_new(&env);
+	return 0;
+}
 
-		sublanguageid_xmlval = xmlrpc_string_new(&env, lang);
-		xmlrpc_struct_set_value(&env, name_query, "sublanguageid", sublanguageid_xmlval);
+/*
+ * a unique name next to path, for writing a file which is renamed to path
+ * once it's complete.
+ */
+static char *tmp_path_for(const char *path) {
+	char *tmp_path = NULL;
+	if (asprintf(&tmp_path, "%s.%d.%08x.tmp", path, getpid(), g_random_int()) == -1)
+		return NULL;
+	return tmp_path;
+}
 
-		filename_xmlval = xmlrpc_string_new(&env, filename);
-		xmlrpc_struct_set_value(&env, name_query, "query", filename_xmlval);
+/*
+ * persistent cache of the file hashes, so unchanged files don't have to
+ * be read again. An entry is valid as long as device, inode, size and
+ * mtime of the file match.
+ *
+ * The file backend is an open addressing table in a shared memory mapping.
+ * It starts with HASH_CACHE_SLOTS and doubles whenever a file finds no free
+ * slot near its own, up to --hash-cache-size entries. Only then are older
+ * entries replaced. Entries carry a checksum, so torn writes from
+ * concurrent processes are simply treated as misses.
+ */
+static uint64_t hash_cache_mix(uint64_t a, uint64_t b) {
+	uint64_t x = a * 0x9e3779b97f4a7c15ull ^ b;
+	x ^= x >> 31;
+	x *= 0xbf58476d1ce4e5b9ull;
+	x ^= x >> 29;
+	return x;
+}
 
-		xmlrpc_array_append_item(&env, query_array, name_query);
+/*
+ * seeded, so the check of an all-zero entry isn't zero and empty slots
+ * count as free.
+ */
+static uint64_t hash_cache_entry_check(const struct hash_cache_entry *e) {
+	uint64_t x = hash_cache_mix(HASH_CACHE_MAGIC, e->dev);
+	x = hash_cache_mix(x, e->ino);
+	x = hash_cache_mix(x, e->size);
+	x = hash_cache_mix(x, e->mtime_sec);
+	x = hash_cache_mix(x, e->mtime_nsec);
+	return hash_cache_mix(x, e->hash);
+}
+
+static void hash_cache_entry_init(struct hash_cache_entry *e, const struct stat *st, uint64_t hash) {
+	e->dev = st->st_dev;
+	e->ino = st->st_ino;
+	e->size = st->st_size;
+	e->mtime_sec = st->st_mtim.tv_sec;
+	e->mtime_nsec = st->st_mtim.tv_nsec;
+	e->hash = hash;
+	e->check = hash_cache_entry_check(e);
+}
+
+static size_t hash_cache_file_size(uint64_t n_slots) {
+	return sizeof(struct hash_cache_header) + n_slots * sizeof(struct hash_cache_entry);
+}
+
+/*
+ * returns the slot for e: the one of the same file or a free one among the
+ * HASH_CACHE_PROBES after its home slot, NULL if they are all taken.
+ */
+static struct hash_cache_entry *hash_cache_slot(struct hash_cache_file *map, uint64_t n_slots,
+                                                const struct hash_cache_entry *e) {
+	uint64_t slot = hash_cache_mix(e->dev, e->ino);
+
+	for (int i = 0; i < HASH_CACHE_PROBES; i++) {
+		struct hash_cache_entry *c = &map->entries[(slot + i) % n_slots];
+		if ((c->dev == e->dev && c->ino == e->ino) || c->check != hash_cache_entry_check(c))
+			return c;
 	}
+	return NULL;
+}
 
-	// create parameter structure (currently only for "limit")
-	param_struct = xmlrpc_struct_new(&env);
-	limit_xmlval = xmlrpc_int_new(&env, limit);
-	xmlrpc_struct_set_value(&env, param_struct, "limit", limit_xmlval);
+/*
+ * creates an empty cache file with n_slots next to path, to be renamed
+ * into place. Files in use by other processes are never truncated, that
+ * would crash them (SIGBUS) on their next access.
+ * Returns the file descriptor, or -1 with errno set.
+ */
+static int hash_cache_create(const char *path, uint64_t n_slots, char **tmp_path) {
+	struct hash_cache_header header = {
+		.magic = HASH_CACHE_MAGIC,
+		.n_slots = n_slots,
+	};
 
-	xmlrpc_client_call2f(&env, client, STH_XMLRPC_URL, "SearchSubtitles", &result, "(sAS)", token, query_array, param_struct);
-	if (env.fault_occurred) {
-		log_err("query failed: %s (%d)", env.fault_string, env.fault_code);
-		return env.fault_code;
+	*tmp_path = tmp_path_for(path);
+	if (!*tmp_path) {
+		errno = ENOMEM;
+		return -1;
 	}
 
-	xmlrpc_struct_read_value(&env, result, "data", data);
-	if (env.fault_occurred) {
-		log_err("failed to get data: %s (%d)", env.fault_string, env.fault_code);
-		return env.fault_code;
+	int fd = open(*tmp_path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (fd == -1)
+		return -1;
+
+	if (ftruncate(fd, hash_cache_file_size(n_slots)) == -1 ||
+	    pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+		int saved_errno = errno;
+		close(fd);
+		unlink(*tmp_path);
+		errno = saved_errno;
+		return -1;
 	}
 
-	return 0;
+	return fd;
 }
 
-static void print_separator(int c, int digit_count) {
-	for (int i = 0; i < c; i++) {
-		if (i == digit_count + 1 ||
-		    i == digit_count + 1 + 4 ||
-		    i == digit_count + 1 + 4 + 6) {
-			fputs(SEP_CROSS, stdout);
-		}
-		else {
-			fputs(SEP_HORIZONTAL, stdout);
-		}
+static void hash_cache_open() {
+	_cleanup_free_ char *dir = NULL;
+	_cleanup_free_ char *path = NULL;
+	_cleanup_free_ char *tmp_path = NULL;
+	_cleanup_close_ int fd = -1;
+	struct stat st;
+	struct hash_cache_header header;
+	uint64_t n_slots = 0;
+
+	if (hash_cache != HASH_CACHE_FILE)
+		return;
+
+	if (asprintf(&dir, "%s/subberthehut", g_get_user_cache_dir()) == -1 ||
+	    asprintf(&path, "%s/hashes", dir) == -1) {
+		log_oom();
+		return;
 	}
-	putchar('\n');
-}
 
-static void print_table(struct sub_info *sub_infos, int n, int align_release_name) {
-	// count number of digits
-	int digit_count = 0;
-	int n_tmp = n;
-	while (n_tmp) {
-		n_tmp /= 10;
-		digit_count++;
+	if (g_mkdir_with_parents(dir, 0700) == -1) {
+		log_err("warning: failed to create %s, not caching hashes: %m", dir);
+		return;
 	}
 
-	// header
-	putchar('\n');
-	int c = printf("%-*c " SEP_VERTICAL " %c " SEP_VERTICAL " %s " SEP_VERTICAL " %-*s\n",
-	               digit_count,
-	               HEADER_ID,
-	               HEADER_MATCHED_BY_HASH,
-	               HEADER_LANG,
-	               align_release_name,
-	               HEADER_RELEASE_NAME);
+	fd = open(path, O_RDWR | O_CLOEXEC);
+	if (fd == -1 && errno != ENOENT) {
+		log_err("warning: failed to open %s, not caching hashes: %m", path);
+		return;
+	}
 
-	c -= 5;
+	// the size of the table is taken from the file, it may have grown before
+	if (fd != -1 && fstat(fd, &st) == 0 &&
+	    pread(fd, &header, sizeof(header), 0) == sizeof(header) && header.magic == HASH_CACHE_MAGIC &&
+	    header.n_slots >= HASH_CACHE_SLOTS && header.n_slots <= SIZE_MAX / sizeof(struct hash_cache_entry) &&
+	    (size_t)st.st_size == hash_cache_file_size(header.n_slots))
+		n_slots = header.n_slots;
+
+	// replace the cache file if it is missing or has an unknown format. A
+	// process creating it at the same time is fine, the last one wins.
+	if (n_slots == 0) {
+		if (fd != -1)
+			close(fd);
+
+		n_slots = HASH_CACHE_SLOTS;
+		fd = hash_cache_create(path, n_slots, &tmp_path);
+		if (fd == -1 || rename(tmp_path, path) == -1) {
+			log_err("warning: failed to initialize %s, not caching hashes: %m", path);
+			if (fd != -1)
+				unlink(tmp_path);
+			return;
+		}
+	}
 
-	// separator
-	print_separator(c, digit_count);
+	void *map = mmap(NULL, hash_cache_file_size(n_slots), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		log_err("warning: failed to map %s, not caching hashes: %m", path);
+		return;
+	}
 
-	// list
-	for (int i = 0; i < n; i++) {
+	hash_cache_map = map;
+	hash_cache_slots = n_slots;
+	hash_cache_path = path;
+	path = NULL;
+}
+
+static void hash_cache_close() {
+	if (hash_cache_map)
+		munmap(hash_cache_map, hash_cache_file_size(hash_cache_slots));
+	hash_cache_map = NULL;
+	free(hash_cache_path);
+	hash_cache_path = NULL;
+}
+
+/*
+ * replaces the cache file by one with twice the slots, unless that would be
+ * more than hash_cache_size. Other processes keep using the old file until
+ * they are restarted. Called with hash_cache_mutex held from the hashing
+ * threads, so this doesn't log.
+ */
+static bool hash_cache_grow() {
+	uint64_t n_slots = hash_cache_slots * 2;
+	if (n_slots > (uint64_t)hash_cache_size || n_slots > SIZE_MAX / sizeof(struct hash_cache_entry))
+		return false;
+
+	_cleanup_free_ char *tmp_path = NULL;
+	_cleanup_close_ int fd = hash_cache_create(hash_cache_path, n_slots, &tmp_path);
+	if (fd == -1)
+		return false;
+
+	void *map = mmap(NULL, hash_cache_file_size(n_slots), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		unlink(tmp_path);
+		return false;
+	}
+
+	struct hash_cache_file *grown = map;
+
+	for (uint64_t i = 0; i < hash_cache_slots; i++) {
+		const struct hash_cache_entry *c = &hash_cache_map->entries[i];
+		if (c->check != hash_cache_entry_check(c))
+			continue;
+
+		struct hash_cache_entry *target = hash_cache_slot(grown, n_slots, c);
+		if (target)
+			*target = *c;
+	}
+
+	if (rename(tmp_path, hash_cache_path) == -1) {
+		munmap(map, hash_cache_file_size(n_slots));
+		unlink(tmp_path);
+		return false;
+	}
+
+	munmap(hash_cache_map, hash_cache_file_size(hash_cache_slots));
+	hash_cache_map = grown;
+	hash_cache_slots = n_slots;
+	return true;
+}
+
+static bool hash_cache_lookup(const char *filepath, const struct stat *st, uint64_t *hash) {
+	struct hash_cache_entry e;
+
+	if (hash_cache == HASH_CACHE_XATTR) {
+		if (getxattr(filepath, HASH_CACHE_XATTR_NAME, &e, sizeof(e)) != sizeof(e))
+			return false;
+		if (e.check != hash_cache_entry_check(&e) || (uint64_t)st->st_size != e.size ||
+		    st->st_mtim.tv_sec != e.mtime_sec || st->st_mtim.tv_nsec != e.mtime_nsec)
+			return false;
+
+		*hash = e.hash;
+		return true;
+	}
+
+	if (!hash_cache_map)
+		return false;
+
+	hash_cache_entry_init(&e, st, 0);
+	uint64_t slot = hash_cache_mix(e.dev, e.ino);
+
+	g_mutex_lock(&hash_cache_mutex);
+	bool found = false;
+	for (int i = 0; i < HASH_CACHE_PROBES && !found; i++) {
+		const struct hash_cache_entry *c = &hash_cache_map->entries[(slot + i) % hash_cache_slots];
+		found = c->dev == e.dev && c->ino == e.ino && c->size == e.size &&
+		        c->mtime_sec == e.mtime_sec && c->mtime_nsec == e.mtime_nsec &&
+		        c->check == hash_cache_entry_check(c);
+		if (found)
+			*hash = c->hash;
+	}
+	g_mutex_unlock(&hash_cache_mutex);
+
+	return found;
+}
+
+static void hash_cache_store(const char *filepath, const struct stat *st, uint64_t hash) {
+	struct hash_cache_entry e;
+	hash_cache_entry_init(&e, st, hash);
+
+	if (hash_cache == HASH_CACHE_XATTR) {
+		// fails e.g. on read-only files or filesystems without xattrs, that's fine
+		setxattr(filepath, HASH_CACHE_XATTR_NAME, &e, sizeof(e), 0);
+		return;
+	}
+
+	if (!hash_cache_map)
+		return;
+
+	// use the slot of this file or a free one, growing the table if there is none,
+	// and once it can't grow anymore, the first one
+	g_mutex_lock(&hash_cache_mutex);
+	struct hash_cache_entry *target;
+	while (!(target = hash_cache_slot(hash_cache_map, hash_cache_slots, &e)) && hash_cache_grow())
+		;
+	if (!target)
+		target = &hash_cache_map->entries[hash_cache_mix(e.dev, e.ino) % hash_cache_slots];
+	*target = e;
+	g_mutex_unlock(&hash_cache_mutex);
+}
+
+/*
+ * returns the code of the fault in env and resets it. A fault left in env
+ * would fail everything using env after it, e.g. all later windows of
+ * --watch.
+ */
+static int env_fault() {
+	int r = env.fault_code;
+	xmlrpc_env_clean(&env);
+	xmlrpc_env_init(&env);
+	return r;
+}
+
+/*
+ * convenience function the get a string value from a xmlrpc struct.
+ */
+static const char *struct_get_string(xmlrpc_value *s, const char *key) {
+	_cleanup_xmlrpc_ xmlrpc_value *xmlval = NULL;
+	const char *str = NULL;
+
+	xmlrpc_struct_find_value(&env, s, key, &xmlval);
+	if (!xmlval)
+		return strdup(""); // missing fields are treated as empty
+
+	xmlrpc_read_string(&env, xmlval, &str);
+
+	return str;
+}
+
+/*
+ * every call to the server is an rpc. rpc_start() sends the request
+ * asynchronously (keeping at most max_jobs in flight), rpc_finish_all()
+ * waits until all responses have arrived. For rpcs with_token, the
+ * session token of the provider is prepended to the parameters when
+ * the request is sent.
+ *
+ * xmlrpc-c can't cancel a request, so the handler gets an rpc_call, which
+ * forgets its rpc when the rpc is abandoned. The response is dropped then,
+ * and the rpc may be cleaned or freed right away. The same way, an rpc
+ * may have two requests in flight with --hedge, and the one answering
+ * first wins.
+ */
+struct rpc_call {
+	struct rpc *rpc;
+	gint64 started;        // monotonic time (µs) this request was sent
+	bool hedge;            // this is the duplicate (--hedge)
+};
+
+/*
+ * records the latency of a search, for the delay of duplicates.
+ */
+static void latency_add(struct provider *provider, gint64 latency) {
+	provider->latencies[provider->n_latencies % HEDGE_SAMPLES] = latency;
+	provider->n_latencies++;
+}
+
+/*
+ * the time after which a duplicate of a search is sent: the --hedge
+ * percentile of the recent latencies of the provider. 0 if there is
+ * no duplicate (yet).
+ */
+static gint64 hedge_delay(const struct provider *provider) {
+	if (hedge_percentile == 0 || provider->n_latencies < HEDGE_MIN_SAMPLES)
+		return 0;
+
+	int n = provider->n_latencies < HEDGE_SAMPLES ? provider->n_latencies : HEDGE_SAMPLES;
+	gint64 latencies[HEDGE_SAMPLES];
+	memcpy(latencies, provider->latencies, n * sizeof(gint64));
+	qsort(latencies, n, sizeof(gint64), compare_durations);
+
+	return percentile(latencies, n, hedge_percentile);
+}
+
+/*
+ * the size of a response as XML. xmlrpc-c doesn't tell how many bytes it
+ * received, so it's serialized again, only if the timings are needed.
+ */
+static size_t response_size(xmlrpc_value *result) {
+	size_t size = 0;
+	xmlrpc_env ser_env;
+	xmlrpc_env_init(&ser_env);
+
+	xmlrpc_mem_block *xml = xmlrpc_mem_block_new(&ser_env, 0);
+	if (!ser_env.fault_occurred) {
+		xmlrpc_serialize_response(&ser_env, xml, result);
+		if (!ser_env.fault_occurred)
+			size = xmlrpc_mem_block_size(xml);
+		xmlrpc_mem_block_free(xml);
+	}
+
+	xmlrpc_env_clean(&ser_env);
+	return size;
+}
+
+static void rpc_handler(const char *server_url, const char *method_name, xmlrpc_value *param_array,
+                        void *user_data, xmlrpc_env *fault, xmlrpc_value *result) {
+	(void)server_url;
+	(void)method_name;
+	(void)param_array;
+
+	struct rpc_call *call = user_data;
+	struct rpc *rpc = call->rpc;
+	gint64 now = g_get_monotonic_time();
+	gint64 latency = now - call->started;
+	bool is_hedge = call->hedge;
+	bool is_current = rpc && call == rpc->call;
+
+	free(call);
+	rpcs_in_flight--;
+	if (!rpc)
+		return;
+
+	// the request still in flight, if any
+	struct rpc_call *other = is_current ? rpc->hedge_call : rpc->call;
+	rpc->call = other;
+	rpc->hedge_call = NULL;
+
+	// the other request may still succeed
+	if (other && fault->fault_occurred)
+		return;
+
+	if (other) {
+		other->rpc = NULL;
+
+		// the duplicate won: the latency of the first request is at least this
+		if (is_hedge)
+			latency_add(rpc->provider, now - other->started);
+	}
+
+	// the result came from the duplicate, whether it answered first or the first request failed
+	if (is_hedge && !fault->fault_occurred)
+		rpcs_hedge_won++;
+
+	if (rpc->hedgeable && !fault->fault_occurred)
+		latency_add(rpc->provider, latency);
+
+	rpc->call = NULL;
+	rpc->hedge_at = 0;
+	rpc->finished = now;
+
+	if (fault->fault_occurred) {
+		rpc->fault_code = fault->fault_code;
+		rpc->fault_string = strdup(fault->fault_string ? fault->fault_string : "");
+	} else {
+		xmlrpc_INCREF(result);
+		rpc->result = result;
+		if (timing)
+			rpc->bytes += response_size(result);
+	}
+}
+
+/*
+ * drops the response of an rpc which is in flight, e.g. because another
+ * provider answered first.
+ */
+static void rpc_abandon(struct rpc *rpc) {
+	if (rpc->call)
+		rpc->call->rpc = NULL;
+	if (rpc->hedge_call)
+		rpc->hedge_call->rpc = NULL;
+	rpc->call = NULL;
+	rpc->hedge_call = NULL;
+	rpc->hedge_at = 0;
+	rpc->abandoned = true;
+
+	if (rpcs_started)
+		g_ptr_array_remove(rpcs_started, rpc);
+}
+
+/*
+ * waits until the monotonic time until (µs), handling the responses
+ * of the rpcs in flight meanwhile.
+ */
+static void rpc_wait(gint64 until) {
+	gint64 now;
+	while ((now = g_get_monotonic_time()) < until) {
+		if (rpcs_in_flight > 0)
+			xmlrpc_client_event_loop_finish_timeout(client, (until - now + 999) / 1000);
+		else
+			g_usleep(until - now);
+	}
+}
+
+/*
+ * token bucket: up to rate_requests requests can be sent at once,
+ * after that one every rate_window / rate_requests seconds.
+ * Takes a token if there is one.
+ */
+static bool rate_take() {
+	if (rate_requests == 0)
+		return true;
+
+	gint64 now = g_get_monotonic_time();
+	if (rate_updated == 0)
+		rate_tokens = rate_requests;
+	else
+		rate_tokens += (double)(now - rate_updated) * rate_requests / ((gint64)rate_window * G_USEC_PER_SEC);
+	if (rate_tokens > rate_requests)
+		rate_tokens = rate_requests;
+	rate_updated = now;
+
+	if (rate_tokens < 1)
+		return false;
+
+	rate_tokens--;
+	return true;
+}
+
+static void rate_limit() {
+	while (!rate_take())
+		rpc_wait(rate_updated + (1 - rate_tokens) * ((gint64)rate_window * G_USEC_PER_SEC) / rate_requests);
+}
+
+/*
+ * the parameters of an rpc as they are sent.
+ */
+static xmlrpc_value *rpc_params(struct rpc *rpc, xmlrpc_env *start_env) {
+	if (!rpc->with_token) {
+		xmlrpc_INCREF(rpc->params);
+		return rpc->params;
+	}
+
+	_cleanup_xmlrpc_ xmlrpc_value *token_xmlval = xmlrpc_string_new(start_env, rpc->provider->token);
+	xmlrpc_value *params = xmlrpc_array_new(start_env);
+	xmlrpc_array_append_item(start_env, params, token_xmlval);
+
+	int n = xmlrpc_array_size(start_env, rpc->params);
+	for (int i = 0; i < n; i++) {
+		_cleanup_xmlrpc_ xmlrpc_value *param = NULL;
+		xmlrpc_array_read_item(start_env, rpc->params, i, &param);
+		xmlrpc_array_append_item(start_env, params, param);
+	}
+
+	return params;
+}
+
+/*
+ * sends a request of an rpc. Returns NULL (with start_env set) if it
+ * can't be sent.
+ */
+static struct rpc_call *rpc_send(struct rpc *rpc, xmlrpc_value *params, bool hedge, xmlrpc_env *start_env) {
+	struct rpc_call *call = malloc(sizeof(struct rpc_call));
+	if (!call) {
+		xmlrpc_faultf(start_env, "out of memory");
+		return NULL;
+	}
+
+	call->rpc = rpc;
+	call->started = g_get_monotonic_time();
+	call->hedge = hedge;
+	rpcs_in_flight++;
+	rpcs_sent++;
+	xmlrpc_client_start_rpc(start_env, client, rpc->provider->server, rpc->method, params, rpc_handler, call);
+	if (start_env->fault_occurred) {
+		rpcs_in_flight--;
+		free(call);
+		return NULL;
+	}
+
+	return call;
+}
+
+static int rpc_login(struct provider *provider, bool force);
+
+static void rpc_start(struct rpc *rpc) {
+	_cleanup_xmlrpc_ xmlrpc_value *params = NULL;
+	xmlrpc_env start_env;
+	xmlrpc_env_init(&start_env);
+
+	// logging in is put off until it's needed, e.g. not at all if everything is cached
+	if (rpc->with_token && !rpc->provider->token && rpc_login(rpc->provider, false) != 0)
+		xmlrpc_faultf(&start_env, "not logged in to %s", rpc->provider->url);
+
+	if (!rpcs_started)
+		rpcs_started = g_ptr_array_new();
+	g_ptr_array_add(rpcs_started, rpc);
+
+	if (!start_env.fault_occurred) {
+		params = rpc_params(rpc, &start_env);
+
+		while (rpcs_in_flight >= max_jobs)
+			xmlrpc_client_event_loop_finish_timeout(client, RPC_POLL_INTERVAL);
+
+		rate_limit();
+	}
+
+	rpc->started = g_get_monotonic_time();
+	if (rpc->first_started == 0)
+		rpc->first_started = rpc->started;
+	rpc->finished = 0;
+	rpc->abandoned = false;
+	rpc->hedge_at = 0;
+	if (!start_env.fault_occurred)
+		rpc->call = rpc_send(rpc, params, false, &start_env);
+
+	if (start_env.fault_occurred) {
+		rpc->call = NULL;
+		rpc->finished = rpc->started;
+		rpc->fault_code = start_env.fault_code;
+		rpc->fault_string = strdup(start_env.fault_string);
+	} else if (rpc->hedgeable) {
+		gint64 delay = hedge_delay(rpc->provider);
+		if (delay > 0)
+			rpc->hedge_at = rpc->started + delay;
+	}
+
+	xmlrpc_env_clean(&start_env);
+}
+
+/*
+ * sends a duplicate of an rpc whose response is late (--hedge), the first
+ * response wins. Duplicates count against --jobs like any request. Nothing
+ * is sent if --jobs requests are in flight, if the duplicates would exceed
+ * --hedge-budget of all requests, or if the rate limit is reached; it's
+ * tried again then.
+ */
+static void rpc_hedge(struct rpc *rpc) {
+	_cleanup_xmlrpc_ xmlrpc_value *params = NULL;
+	xmlrpc_env start_env;
+
+	if (rpcs_in_flight >= max_jobs || (rpcs_hedged + 1) * 100 > hedge_budget * (rpcs_sent + 1) || !rate_take())
+		return;
+
+	xmlrpc_env_init(&start_env);
+	rpc->hedge_at = 0;
+
+	params = rpc_params(rpc, &start_env);
+	if (!start_env.fault_occurred)
+		rpc->hedge_call = rpc_send(rpc, params, true, &start_env);
+	if (rpc->hedge_call)
+		rpcs_hedged++;
+
+	xmlrpc_env_clean(&start_env);
+}
+
+/*
+ * forgets the response of an rpc, so it can be sent again.
+ */
+static void rpc_reset(struct rpc *rpc) {
+	if (rpc->result)
+		xmlrpc_DECREF(rpc->result);
+	rpc->result = NULL;
+
+	free(rpc->fault_string);
+	rpc->fault_string = NULL;
+	rpc->fault_code = 0;
+}
+
+/*
+ * returns the numeric "status" of a response, e.g. 200 for "200 OK"
+ * or 401 for "401 Unauthorized" (invalid or expired session token).
+ * Returns 0 if the response has no status.
+ */
+static int rpc_status(struct rpc *rpc) {
+	_cleanup_xmlrpc_ xmlrpc_value *status_xmlval = NULL;
+	_cleanup_free_ const char *status = NULL;
+	xmlrpc_env status_env;
+	int code = 0;
+
+	if (!rpc->result)
+		return 0;
+
+	xmlrpc_env_init(&status_env);
+	xmlrpc_struct_find_value(&status_env, rpc->result, "status", &status_xmlval);
+	if (!status_env.fault_occurred && status_xmlval) {
+		xmlrpc_read_string(&status_env, status_xmlval, &status);
+		if (!status_env.fault_occurred)
+			code = strtol(status, NULL, 10);
+	}
+	xmlrpc_env_clean(&status_env);
+
+	return code;
+}
+
+static bool rpc_unauthorized(struct rpc *rpc) {
+	return rpc->with_token && rpc_status(rpc) == 401;
+}
+
+/*
+ * returns the HTTP status of a network error, e.g. 404 for
+ * "HTTP response code is 404, not 200". Returns 0 if the request didn't
+ * get an HTTP response (connection errors, timeouts).
+ */
+static int rpc_http_status(struct rpc *rpc) {
+	const char *code = rpc->fault_string ? strstr(rpc->fault_string, "HTTP response code is ") : NULL;
+	if (!code)
+		return 0;
+
+	return strtol(code + strlen("HTTP response code is "), NULL, 10);
+}
+
+static bool status_retryable(int status) {
+	return status == 429 || (status >= 500 && status <= 599);
+}
+
+/*
+ * the messages of the libcurl errors which are worth another try: timeouts
+ * and connections which broke off. A host which can't be resolved or which
+ * refuses the connection (e.g. a wrong --url) won't be any different later.
+ */
+static const char *transient_errors[] = {
+	"Timeout was reached",
+	"Connection reset",
+	"Failure when receiving data from the peer",
+	"Failed sending data to the peer",
+	"Server returned nothing",
+	NULL
+};
+
+/*
+ * timeouts, broken connections and the server being overloaded are worth
+ * another try, anything else (e.g. 403, 404 or an unknown host) isn't.
+ */
+static bool rpc_retryable(struct rpc *rpc) {
+	if (rpc->with_token && rpc->provider->login_r != 0)
+		return false;
+
+	if (rpc->fault_code == XMLRPC_TIMEOUT_ERROR)
+		return true;
+
+	// xmlrpc-c reports HTTP errors as network errors, too
+	if (rpc->fault_code == XMLRPC_NETWORK_ERROR) {
+		int status = rpc_http_status(rpc);
+		if (status != 0)
+			return status_retryable(status);
+
+		for (const char **e = transient_errors; *e && rpc->fault_string; e++) {
+			if (strstr(rpc->fault_string, *e))
+				return true;
+		}
+		return false;
+	}
+
+	if (rpc->fault_code != 0)
+		return false;
+
+	return status_retryable(rpc_status(rpc));
+}
+
+/*
+ * the delay before the next retry: exponential backoff, half of it jittered,
+ * so many clients (or jobs) don't retry in lockstep.
+ */
+static gint64 rpc_backoff(int retries) {
+	gint64 delay = RETRY_BASE_DELAY;
+	for (int i = 0; i < retries && delay < RETRY_MAX_DELAY; i++)
+		delay *= 2;
+	if (delay > RETRY_MAX_DELAY)
+		delay = RETRY_MAX_DELAY;
+
+	return delay / 2 + g_random_double() * (delay / 2);
+}
+
+/*
+ * logs faults and error statuses of an rpc.
+ */
+static int rpc_check(struct rpc *rpc) {
+	if (rpc->fault_code != 0) {
+		log_err("query failed: %s (%d)", rpc->fault_string, rpc->fault_code);
+		return rpc->fault_code;
+	}
+
+	int status = rpc_status(rpc);
+	if (status != 0 && status != 200) {
+		log_err("query failed: status %d", status);
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * handles an answered rpc: it's sent again after logging in again (once
+ * per rpc) if the session was rejected, or after its backoff if it failed
+ * temporarily. Returns true if the rpc is complete.
+ */
+static bool rpc_settle(struct rpc *rpc) {
+	struct provider *provider = rpc->provider;
+
+	if (rpc->retry_at == 0 && !rpc->relogged_in && rpc_unauthorized(rpc)) {
+		// rpcs sent with an old token don't need another login
+		if (provider->logged_in < rpc->started && rpc_login(provider, true) != 0)
+			return true;
+
+		rpc->relogged_in = true;
+		rpc_reset(rpc);
+		rpc_start(rpc);
+		return false;
+	}
+
+	if (rpc->retry_at == 0 && rpc->retries < max_retries && rpc_retryable(rpc)) {
+		if (rpc->fault_code != 0)
+			log_info("%s failed: %s (%d), retrying...", rpc->method, rpc->fault_string, rpc->fault_code);
+		else
+			log_info("%s failed: status %d, retrying...", rpc->method, rpc_status(rpc));
+
+		rpc->retry_at = g_get_monotonic_time() + rpc_backoff(rpc->retries);
+	}
+
+	if (rpc->retry_at == 0)
+		return true;
+
+	if (g_get_monotonic_time() < rpc->retry_at) {
+		g_ptr_array_add(rpcs_started, rpc);
+		return false;
+	}
+
+	rpc->retry_at = 0;
+	rpc->retries++;
+	rpc_reset(rpc);
+	rpc_start(rpc);
+	return false;
+}
+
+/*
+ * waits until every started rpc is answered for good or abandoned,
+ * handling the responses as they arrive. The complete callback of an rpc
+ * may abandon others.
+ */
+static void rpc_finish_all() {
+	while (rpcs_started && rpcs_started->len > 0) {
+		// rpcs which are still needed (or resent) go to a new list
+		GPtrArray *rpcs = rpcs_started;
+		rpcs_started = g_ptr_array_new();
+
+		bool answered = false;
+		gint64 next_retry = 0;
+		for (guint i = 0; i < rpcs->len; i++) {
+			struct rpc *rpc = g_ptr_array_index(rpcs, i);
+			if (!rpc->call && rpc->retry_at == 0)
+				answered = true;
+			else if (rpc->retry_at != 0 && (next_retry == 0 || rpc->retry_at < next_retry))
+				next_retry = rpc->retry_at;
+		}
+
+		if (!answered && rpcs_in_flight > 0)
+			xmlrpc_client_event_loop_finish_timeout(client, RPC_POLL_INTERVAL);
+		else if (!answered && next_retry != 0)
+			rpc_wait(next_retry);
+
+		for (guint i = 0; i < rpcs->len; i++) {
+			struct rpc *rpc = g_ptr_array_index(rpcs, i);
+			if (rpc->abandoned)
+				continue;
+
+			if (rpc->call && rpc->hedge_at != 0 && g_get_monotonic_time() >= rpc->hedge_at)
+				rpc_hedge(rpc);
+
+			if (rpc->call)
+				g_ptr_array_add(rpcs_started, rpc);
+			else if (rpc_settle(rpc) && rpc->complete)
+				rpc->complete(rpc, rpc->complete_data);
+		}
+
+		g_ptr_array_free(rpcs, TRUE);
+	}
+}
+
+/*
+ * convenience function for a single synchronous rpc.
+ */
+static int rpc_call(struct rpc *rpc) {
+	rpc_start(rpc);
+	rpc_finish_all();
+
+	return rpc->fault_code;
+}
+
+static void rpc_clean(struct rpc *rpc) {
+	// the rpc might still be in flight or waiting for a retry
+	rpc_abandon(rpc);
+	if (rpc->params)
+		xmlrpc_DECREF(rpc->params);
+	if (rpc->result)
+		xmlrpc_DECREF(rpc->result);
+	free(rpc->fault_string);
+
+	memset(rpc, 0, sizeof(struct rpc));
+}
+
+/*
+ * the session token is kept in a user-private file, so the next run
+ * doesn't have to log in again. The mtime of the file is the time the
+ * token was last used, the file contains the time it was acquired.
+ */
+static char *token_cache_path(const struct provider *provider) {
+	char *path = NULL;
+
+	// tokens of other servers (--url) are kept apart
+	if (strcmp(provider->url, STH_XMLRPC_URL) == 0) {
+		if (asprintf(&path, "%s/subberthehut/token", g_get_user_cache_dir()) == -1)
+			return NULL;
+	} else {
+		gchar *checksum = g_compute_checksum_for_string(G_CHECKSUM_SHA1, provider->url, -1);
+		if (asprintf(&path, "%s/subberthehut/token-%.16s", g_get_user_cache_dir(), checksum) == -1)
+			path = NULL;
+		g_free(checksum);
+	}
+	return path;
+}
+
+static bool token_cache_load(struct provider *provider) {
+	_cleanup_free_ char *path = token_cache_path(provider);
+	_cleanup_fclose_ FILE *f = NULL;
+	_cleanup_free_ char *line = NULL;
+	size_t len = 0;
+	struct stat st;
+
+	if (!path || !(f = fopen(path, "re")) || fstat(fileno(f), &st) == -1)
+		return false;
+
+	// don't use tokens which other users could have read or changed
+	if (st.st_uid != getuid() || (st.st_mode & 0077))
+		return false;
+
+	if (time(NULL) - st.st_mtime > TOKEN_IDLE_TIMEOUT)
+		return false;
+
+	ssize_t n = getline(&line, &len, f);
+	if (n <= 0)
+		return false;
+	if (line[n - 1] == '\n')
+		line[n - 1] = '\0';
+
+	char *space = strchr(line, ' ');
+	if (!space || !space[1])
+		return false;
+
+	provider->token = strdup(space + 1);
+	return provider->token != NULL;
+}
+
+static void token_cache_save(const struct provider *provider) {
+	_cleanup_free_ char *path = token_cache_path(provider);
+	_cleanup_free_ char *dir = NULL;
+	_cleanup_free_ char *tmp_path = NULL;
+	_cleanup_close_ int fd = -1;
+	_cleanup_free_ char *content = NULL;
+
+	if (!path || !(dir = strdup(path)))
+		return;
+	*strrchr(dir, '/') = '\0';
+
+	if (g_mkdir_with_parents(dir, 0700) == -1 ||
+	    asprintf(&tmp_path, "%s.%d.tmp", path, getpid()) == -1 ||
+	    asprintf(&content, "%ld %s\n", (long)time(NULL), provider->token) == -1)
+		return;
+
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd == -1)
+		return;
+
+	if (write(fd, content, strlen(content)) != (ssize_t)strlen(content) || rename(tmp_path, path) == -1)
+		unlink(tmp_path);
+}
+
+/*
+ * marks the cached token as used, so it's kept for another TOKEN_IDLE_TIMEOUT.
+ */
+static void token_cache_touch(const struct provider *provider) {
+	_cleanup_free_ char *path = token_cache_path(provider);
+	if (path)
+		utimensat(AT_FDCWD, path, NULL, 0);
+}
+
+static void login_start(struct provider *provider, struct rpc *rpc) {
+	rpc->provider = provider;
+	rpc->method = "LogIn";
+	rpc->params = xmlrpc_build_value(&env, "(ssss)", "", "", LOGIN_LANGCODE, LOGIN_USER_AGENT);
+	rpc_start(rpc);
+}
+
+/*
+ * takes the session token from the response of a LogIn rpc.
+ */
+static int login_finish(struct provider *provider, struct rpc *rpc) {
+	_cleanup_xmlrpc_ xmlrpc_value *token_xmlval = NULL;
+	_cleanup_free_ const char *status = NULL;
+
+	trace_span(PHASE_LOGIN, rpc->first_started, rpc->finished, NULL, rpc->bytes);
+	if (rpc->fault_code != 0) {
+		log_err("login to %s failed: %s (%d)", provider->url, rpc->fault_string, rpc->fault_code);
+		return rpc->fault_code;
+	}
+
+	status = struct_get_string(rpc->result, "status");
+	if (strcmp(status, "200 OK")) {
+		log_err("login to %s failed: %s", provider->url, status);
+		return 1;
+	}
+
+	free((void *)provider->token);
+	provider->token = NULL;
+
+	xmlrpc_struct_find_value(&env, rpc->result, "token", &token_xmlval);
+	xmlrpc_read_string(&env, token_xmlval, &provider->token);
+	if (env.fault_occurred) {
+		log_err("login to %s failed: %s (%d)", provider->url, env.fault_string, env.fault_code);
+		return env_fault();
+	}
+
+	provider->logged_in = g_get_monotonic_time();
+	token_cache_save(provider);
+
+	return 0;
+}
+
+/*
+ * a provider which can't be logged in to isn't tried again.
+ */
+static void login_failed(struct provider *provider, int r) {
+	provider->login_r = r;
+	if (n_providers > 1)
+		log_err("warning: leaving out %s.", provider->url);
+}
+
+/*
+ * logs in to a provider while other rpcs are in flight: on the first rpc
+ * which needs the session token (unless there is a cached one), or again
+ * once the token is rejected. The other rpcs are set aside, so rpc_call()
+ * only waits for the login.
+ */
+static int rpc_login(struct provider *provider, bool force) {
+	_cleanup_rpc_ struct rpc rpc = {0};
+
+	if (provider->login_r != 0)
+		return provider->login_r;
+
+	if (!force && token_cache_load(provider))
+		return 0;
+
+	if (force)
+		log_info("session of %s expired, logging in again...", provider->url);
+
+	GPtrArray *pending = rpcs_started;
+	rpcs_started = NULL;
+
+	login_start(provider, &rpc);
+	rpc_finish_all();
+	int r = login_finish(provider, &rpc);
+
+	if (rpcs_started)
+		g_ptr_array_free(rpcs_started, TRUE);
+	rpcs_started = pending;
+
+	if (r != 0)
+		login_failed(provider, r);
+	return r;
+}
+
+/*
+ * logs in to every provider without a session at once, before they are
+ * searched. Like rpc_login(), the other rpcs are set aside meanwhile.
+ */
+static void login_all() {
+	struct rpc rpcs[MAX_PROVIDERS] = {{0}};
+	bool started = false;
+
+	GPtrArray *pending = rpcs_started;
+	rpcs_started = NULL;
+
+	for (int p = 0; p < n_providers; p++) {
+		struct provider *provider = &providers[p];
+		if (provider->token || provider->login_r != 0 || token_cache_load(provider))
+			continue;
+
+		login_start(provider, &rpcs[p]);
+		started = true;
+	}
+
+	if (started)
+		rpc_finish_all();
+
+	for (int p = 0; p < n_providers; p++) {
+		if (rpcs[p].method) {
+			int r = login_finish(&providers[p], &rpcs[p]);
+			if (r != 0)
+				login_failed(&providers[p], r);
+		}
+		rpc_clean(&rpcs[p]);
+	}
+
+	if (rpcs_started)
+		g_ptr_array_free(rpcs_started, TRUE);
+	rpcs_started = pending;
+}
+
+/*
+ * creates the hash-based and/or the name-based query for a single file and
+ * appends them to query_array.
+ */
+static int append_queries(xmlrpc_value *query_array, const struct file_job *job) {
+	_cleanup_xmlrpc_ xmlrpc_value *hash_query = NULL;
+	_cleanup_xmlrpc_ xmlrpc_value *sublanguageid_xmlval = NULL;
+	_cleanup_xmlrpc_ xmlrpc_value *hash_xmlval = NULL;
+	_cleanup_xmlrpc_ xmlrpc_value *filesize_xmlval = NULL;
+	_cleanup_free_ char *hash_str = NULL;
+	_cleanup_free_ char *filesize_str = NULL;
+
+	_cleanup_xmlrpc_ xmlrpc_value *name_query = NULL;
+	_cleanup_xmlrpc_ xmlrpc_value *filename_xmlval = NULL;
+
+	sublanguageid_xmlval = xmlrpc_string_new(&env, lang);
+
+	// create hash-based query
+	if (!name_search_only) {
+		hash_query = xmlrpc_struct_new(&env);
+		xmlrpc_struct_set_value(&env, hash_query, "sublanguageid", sublanguageid_xmlval);
+		int r = asprintf(&hash_str, "%016" PRIx64, job->hash);
+		if (r == -1)
+			return log_oom();
+
+		hash_xmlval = xmlrpc_string_new(&env, hash_str);
+		xmlrpc_struct_set_value(&env, hash_query, "moviehash", hash_xmlval);
+
+		r = asprintf(&filesize_str, "%" PRIu64, job->filesize);
+		if (r == -1)
+			return log_oom();
+
+		filesize_xmlval = xmlrpc_string_new(&env, filesize_str);
+		xmlrpc_struct_set_value(&env, hash_query, "moviebytesize", filesize_xmlval);
+
+		xmlrpc_array_append_item(&env, query_array, hash_query);
+	}
+
+	// create full-text query
+	if (!hash_search_only) {
+		name_query = xmlrpc_struct_new(&env);
+		xmlrpc_struct_set_value(&env, name_query, "sublanguageid", sublanguageid_xmlval);
+
+		filename_xmlval = xmlrpc_string_new(&env, job->filename);
+		xmlrpc_struct_set_value(&env, name_query, "query", filename_xmlval);
+
+		xmlrpc_array_append_item(&env, query_array, name_query);
+	}
+
+	return 0;
+}
+
+/*
+ * finds the job a single search result belongs to.
+ * The server tells us the index of the query which produced the result
+ * ("QueryNumber"), hash-based results can also be matched by "MovieHash".
+ */
+static struct file_job *route_result(xmlrpc_value *oneresult, struct file_job **query_jobs, int n_queries) {
+	_cleanup_xmlrpc_ xmlrpc_value *query_number_xmlval = NULL;
+	_cleanup_xmlrpc_ xmlrpc_value *movie_hash_xmlval = NULL;
+
+	xmlrpc_struct_find_value(&env, oneresult, "QueryNumber", &query_number_xmlval);
+	if (query_number_xmlval) {
+		_cleanup_free_ const char *query_number_str = NULL;
+		xmlrpc_read_string(&env, query_number_xmlval, &query_number_str);
+		if (!env.fault_occurred) {
+			char *endptr = NULL;
+			long q = strtol(query_number_str, &endptr, 10);
+			if (*endptr == '\0' && q >= 0 && q < n_queries)
+				return query_jobs[q];
+		}
+		xmlrpc_env_clean(&env);
+		xmlrpc_env_init(&env);
+	}
+
+	xmlrpc_struct_find_value(&env, oneresult, "MovieHash", &movie_hash_xmlval);
+	if (movie_hash_xmlval) {
+		_cleanup_free_ const char *movie_hash_str = NULL;
+		xmlrpc_read_string(&env, movie_hash_xmlval, &movie_hash_str);
+		if (!env.fault_occurred) {
+			uint64_t movie_hash = strtoull(movie_hash_str, NULL, 16);
+			for (int q = 0; q < n_queries; q++) {
+				if (query_jobs[q]->hash == movie_hash)
+					return query_jobs[q];
+			}
+		}
+		xmlrpc_env_clean(&env);
+		xmlrpc_env_init(&env);
+	}
+
+	// all queries belong to the same file, so the result can only belong to it
+	return n_queries > 0 && query_jobs[0] == query_jobs[n_queries - 1] ? query_jobs[0] : NULL;
+}
+
+/*
+ * local cache of search results, so repeated searches for the same file
+ * with the same options don't need the server. Every entry is a file
+ * containing the serialized results, named by a checksum of everything
+ * which influences the search. It is valid for search_cache_ttl seconds
+ * after it was written.
+ */
+static char *search_cache_path(const struct file_job *job, const struct provider *provider) {
+	_cleanup_free_ char *filename = strdup(job->filename);
+	_cleanup_free_ char *key = NULL;
+	char *path = NULL;
+
+	if (!filename)
+		return NULL;
+
+	for (char *c = filename; *c; c++)
+		*c = g_ascii_tolower(*c);
+
+	if (asprintf(&key, "%016" PRIx64 " %" PRIu64 " %s %d %d %d %d %s %s",
+	             job->hash, job->filesize, search_cache_langs, limit, per_language,
+	             hash_search_only, name_search_only, filename, provider->url) == -1)
+		return NULL;
+
+	gchar *checksum = g_compute_checksum_for_string(G_CHECKSUM_SHA1, key, -1);
+	if (asprintf(&path, "%s/%s.xml", search_cache_dir, checksum) == -1)
+		path = NULL;
+	g_free(checksum);
+
+	return path;
+}
+
+static int compare_strings(const void *a, const void *b) {
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static int compare_cache_entries(const void *a, const void *b) {
+	const struct search_cache_entry *x = a, *y = b;
+	return (x->mtime > y->mtime) - (x->mtime < y->mtime);
+}
+
+/*
+ * prepares the search cache: removes expired entries and,
+ * if there are more than search_cache_size entries, the oldest ones.
+ */
+static void search_cache_open() {
+	_cleanup_free_ struct search_cache_entry *entries = NULL;
+	size_t n_entries = 0, n_alloc = 0;
+
+	if (search_cache_ttl == 0)
+		return;
+
+	// the same languages in another order or case should produce the same key
+	gchar **langs = g_strsplit(lang, ",", -1);
+	for (gchar **l = langs; *l; l++) {
+		for (char *c = *l; *c; c++)
+			*c = g_ascii_tolower(*c);
+	}
+	qsort(langs, g_strv_length(langs), sizeof(gchar *), compare_strings);
+	search_cache_langs = g_strjoinv(",", langs);
+	g_strfreev(langs);
+
+	if (asprintf(&search_cache_dir, "%s/subberthehut/search", g_get_user_cache_dir()) == -1) {
+		search_cache_dir = NULL;
+		log_oom();
+		return;
+	}
+
+	if (g_mkdir_with_parents(search_cache_dir, 0700) == -1) {
+		log_err("warning: failed to create %s, not caching search results: %m", search_cache_dir);
+		free(search_cache_dir);
+		search_cache_dir = NULL;
+		return;
+	}
+
+	DIR *dir = opendir(search_cache_dir);
+	if (!dir)
+		return;
+
+	time_t now = time(NULL);
+	struct dirent *de;
+	while ((de = readdir(dir))) {
+		struct stat st;
+		if (de->d_name[0] == '.' || strlen(de->d_name) >= sizeof(entries->name) ||
+		    fstatat(dirfd(dir), de->d_name, &st, 0) == -1)
+			continue;
+
+		if (st.st_mtime + search_cache_ttl < now) {
+			unlinkat(dirfd(dir), de->d_name, 0);
+			continue;
+		}
+
+		if (n_entries == n_alloc) {
+			n_alloc = n_alloc ? n_alloc * 2 : 64;
+			struct search_cache_entry *tmp = realloc(entries, n_alloc * sizeof(struct search_cache_entry));
+			if (!tmp)
+				break;
+			entries = tmp;
+		}
+		entries[n_entries].mtime = st.st_mtime;
+		strcpy(entries[n_entries].name, de->d_name);
+		n_entries++;
+	}
+
+	if (n_entries > (size_t)search_cache_size) {
+		qsort(entries, n_entries, sizeof(struct search_cache_entry), compare_cache_entries);
+		for (size_t i = 0; i < n_entries - search_cache_size; i++)
+			unlinkat(dirfd(dir), entries[i].name, 0);
+	}
+
+	closedir(dir);
+}
+
+static bool search_cache_load(struct file_job *job, const struct provider *provider) {
+	_cleanup_free_ char *path = NULL;
+	gchar *xml = NULL;
+	gsize len = 0;
+	struct stat st;
+	bool found = false;
+
+	if (!search_cache_dir)
+		return false;
+
+	path = search_cache_path(job, provider);
+	if (!path || stat(path, &st) == -1 || st.st_mtime + search_cache_ttl < time(NULL))
+		return false;
+
+	if (!g_file_get_contents(path, &xml, &len, NULL))
+		return false;
+
+	xmlrpc_env parse_env;
+	xmlrpc_env_init(&parse_env);
+	xmlrpc_parse_value_xml(&parse_env, xml, len, &job->results);
+	if (parse_env.fault_occurred) {
+		job->results = NULL;
+	} else if (xmlrpc_value_type(job->results) != XMLRPC_TYPE_ARRAY) {
+		xmlrpc_DECREF(job->results);
+		job->results = NULL;
+	} else {
+		found = true;
+	}
+	xmlrpc_env_clean(&parse_env);
+	g_free(xml);
+
+	return found;
+}
+
+/*
+ * takes the cached results of the first provider which has some.
+ */
+static bool search_cache_lookup(struct file_job *job) {
+	for (int p = 0; p < n_providers; p++) {
+		if (search_cache_load(job, &providers[p])) {
+			job->provider = &providers[p];
+			return true;
+		}
+	}
+	return false;
+}
+
+static void search_cache_store(const struct file_job *job) {
+	_cleanup_free_ char *path = NULL;
+	_cleanup_free_ char *tmp_path = NULL;
+
+	if (!search_cache_dir || !job->results || job->search_cached || !job->provider)
+		return;
+
+	// only cache files with results, so the next run tries again
+	xmlrpc_env ser_env;
+	xmlrpc_env_init(&ser_env);
+	if (xmlrpc_array_size(&ser_env, job->results) <= 0)
+		goto finish;
+
+	path = search_cache_path(job, job->provider);
+	if (!path || asprintf(&tmp_path, "%s.%d.tmp", path, getpid()) == -1)
+		goto finish;
+
+	xmlrpc_mem_block *xml = xmlrpc_mem_block_new(&ser_env, 0);
+	if (ser_env.fault_occurred)
+		goto finish;
+
+	xmlrpc_serialize_value(&ser_env, xml, job->results);
+	if (!ser_env.fault_occurred &&
+	    g_file_set_contents(tmp_path, xmlrpc_mem_block_contents(xml), xmlrpc_mem_block_size(xml), NULL) &&
+	    rename(tmp_path, path) == -1)
+		unlink(tmp_path);
+	xmlrpc_mem_block_free(xml);
+
+finish:
+	xmlrpc_env_clean(&ser_env);
+}
+
+/*
+ * sends the queries of the jobs of a search in a single SearchSubtitles
+ * call. If starved, only the jobs which got no results are searched again.
+ */
+static int search_send(struct search *search, bool starved) {
+	_cleanup_xmlrpc_ xmlrpc_value *query_array = NULL;
+
+	_cleanup_xmlrpc_ xmlrpc_value *limit_xmlval = NULL;
+	_cleanup_xmlrpc_ xmlrpc_value *param_struct = NULL;
+
+	struct batch *batch = search->batch;
+
+	query_array = xmlrpc_array_new(&env);
+	search->n_queries = 0;
+
+	for (int i = 0; i < batch->n_searched; i++) {
+		struct file_job *job = &batch->jobs[i];
+		if (job->r != 0 || job->search_cached || job->stored)
+			continue;
+		if (starved && (!search->results[i] || xmlrpc_array_size(&env, search->results[i]) > 0))
+			continue;
+
+		int r = append_queries(query_array, job);
+		if (r != 0)
+			return r;
+
+		while (search->n_queries < xmlrpc_array_size(&env, query_array))
+			search->query_jobs[search->n_queries++] = job;
+
+		if (!search->results[i])
+			search->results[i] = xmlrpc_array_new(&env);
+	}
+
+	if (search->n_queries == 0) {
+		search->done = true;
+		return 0;
+	}
+
+	/* create parameter structure (currently only for "limit").
+	 * The limit is applied to the whole call, so it is scaled with
+	 * the number of files (and languages with --per-language), up to
+	 * the maximum of the server. The per-file limit is applied in
+	 * search_finish(). */
+	search->call_limit = limit * search->n_queries * (per_language ? n_langs : 1);
+	if (search->call_limit > SEARCH_LIMIT_MAX)
+		search->call_limit = SEARCH_LIMIT_MAX;
+
+	param_struct = xmlrpc_struct_new(&env);
+	limit_xmlval = xmlrpc_int_new(&env, search->call_limit);
+	xmlrpc_struct_set_value(&env, param_struct, "limit", limit_xmlval);
+
+	search->rpc.method = "SearchSubtitles";
+	search->rpc.params = xmlrpc_build_value(&env, "(AS)", query_array, param_struct);
+	search->rpc.with_token = true;
+	rpc_start(&search->rpc);
+
+	return 0;
+}
+
+/*
+ * searches the first n jobs of a batch (that haven't failed yet).
+ */
+static int search_start(struct search *search, int n) {
+	// every file produces up to two queries
+	search->query_jobs = calloc(n, 2 * sizeof(struct file_job *));
+	search->results = calloc(n, sizeof(xmlrpc_value *));
+	search->hash_matched = calloc(n, sizeof(bool));
+	search->lang_counts = calloc(n, sizeof(GHashTable *));
+	if (!search->query_jobs || !search->results || !search->hash_matched || !search->lang_counts)
+		return log_oom();
+
+	return search_send(search, false);
+}
+
+/*
+ * searches the jobs which got no results again, after a full response.
+ */
+static int search_resend(struct search *search) {
+	xmlrpc_DECREF(search->rpc.params);
+	search->rpc.params = NULL;
+	rpc_reset(&search->rpc);
+	search->rpc.retries = 0;
+	search->rpc.relogged_in = false;
+	search->n_starved = 0;
+
+	return search_send(search, true);
+}
+
+/*
+ * counts result for the limit per language of --per-language, unless
+ * its language already has limit results for the jth job.
+ */
+static bool count_lang(struct search *search, int j, xmlrpc_value *result) {
+	char *sub_lang = (char *)struct_get_string(result, "SubLanguageID");
+	if (!sub_lang)
+		return false;
+
+	if (!search->lang_counts[j])
+		search->lang_counts[j] = g_hash_table_new_full(g_str_hash, g_str_equal, free, NULL);
+
+	int count = GPOINTER_TO_INT(g_hash_table_lookup(search->lang_counts[j], sub_lang));
+	if (count >= limit) {
+		free(sub_lang);
+		return false;
+	}
+
+	g_hash_table_replace(search->lang_counts[j], sub_lang, GINT_TO_POINTER(count + 1));
+	return true;
+}
+
+/*
+ * distributes the results of the SearchSubtitles call of a search to
+ * the jobs of its batch.
+ */
+static int search_finish(struct search *search) {
+	_cleanup_xmlrpc_ xmlrpc_value *data = NULL;
+
+	if (search->n_queries == 0)
+		return 0;
+
+	int r = rpc_check(&search->rpc);
+	if (r != 0)
+		return r;
+
+	xmlrpc_struct_read_value(&env, search->rpc.result, "data", &data);
+	if (env.fault_occurred) {
+		log_err("failed to get data: %s (%d)", env.fault_string, env.fault_code);
+		return env_fault();
+	}
+
+	// the server returns a boolean instead of an empty array if nothing was found
+	if (xmlrpc_value_type(data) != XMLRPC_TYPE_ARRAY)
+		return 0;
+
+	int data_length = xmlrpc_array_size(&env, data);
+	if (env.fault_occurred) {
+		log_err("failed to get array size: %s (%d)", env.fault_string, env.fault_code);
+		return env_fault();
+	}
+
+	for (int i = 0; i < data_length; i++) {
+		_cleanup_xmlrpc_ xmlrpc_value *oneresult = NULL;
+		xmlrpc_array_read_item(&env, data, i, &oneresult);
+
+		struct file_job *job = route_result(oneresult, search->query_jobs, search->n_queries);
+		if (!job)
+			continue;
+
+		int j = job - search->batch->jobs;
+		if (per_language ? !count_lang(search, j, oneresult)
+		                 : xmlrpc_array_size(&env, search->results[j]) >= limit)
+			continue;
+
+		xmlrpc_array_append_item(&env, search->results[j], oneresult);
+
+		_cleanup_free_ const char *matched_by_str = struct_get_string(oneresult, "MatchedBy");
+		if (matched_by_str && strcmp(matched_by_str, "moviehash") == 0)
+			search->hash_matched[j] = true;
+	}
+
+	/* a full response might have crowded out the results of the later
+	 * files. Unless none of the files got any, they are searched again. */
+	if (data_length >= search->call_limit) {
+		int n_queried = 0;
+		for (int q = 0; q < search->n_queries; q++) {
+			if (q > 0 && search->query_jobs[q] == search->query_jobs[q - 1])
+				continue;
+
+			n_queried++;
+			if (xmlrpc_array_size(&env, search->results[search->query_jobs[q] - search->batch->jobs]) == 0)
+				search->n_starved++;
+		}
+		if (search->n_starved == n_queried)
+			search->n_starved = 0;
+	}
+
+	return 0;
+}
+
+/*
+ * takes the results of a search for the jth job of its batch.
+ */
+static void search_take(struct search *search, int j) {
+	struct file_job *job = &search->batch->jobs[j];
+
+	job->results = search->results[j];
+	search->results[j] = NULL;
+	job->provider = search->provider;
+
+	// the whole search, with retries, and its bytes on the span of the first job which takes them
+	trace_job(job, PHASE_SEARCH, search->rpc.first_started, search->rpc.finished, search->rpc.bytes);
+	search->rpc.bytes = 0;
+}
+
+/*
+ * fan-out: every file of a batch takes the results of the first provider
+ * which answers with a hash match for it. Once all providers have answered,
+ * the other files take the results of the first provider (in the order of
+ * --url) which has any. The searches which aren't needed anymore are
+ * abandoned.
+ */
+static void search_decide(struct batch *batch) {
+	bool all_done = true;
+	for (int p = 0; p < n_providers; p++)
+		all_done = all_done && batch->searches[p].done;
+
+	bool all_decided = true;
+	for (int j = 0; j < batch->n_searched; j++) {
+		struct file_job *job = &batch->jobs[j];
+		if (job->r != 0 || job->results || job->search_cached || job->stored)
+			continue;
+
+		for (int p = 0; p < n_providers && !job->results; p++) {
+			struct search *search = &batch->searches[p];
+			if (search->done && search->r == 0 && search->hash_matched[j])
+				search_take(search, j);
+		}
+
+		for (int p = 0; p < n_providers && !job->results && all_done; p++) {
+			struct search *search = &batch->searches[p];
+			if (search->r == 0 && search->results[j] && xmlrpc_array_size(&env, search->results[j]) > 0)
+				search_take(search, j);
+		}
+
+		for (int p = 0; p < n_providers && !job->results && all_done; p++) {
+			struct search *search = &batch->searches[p];
+			if (search->r == 0 && search->results[j])
+				search_take(search, j);
+		}
+
+		// every provider failed
+		if (!job->results && all_done)
+			job->r = batch->searches[0].r;
+
+		if (!job->results && job->r == 0)
+			all_decided = false;
+	}
+
+	if (!all_decided)
+		return;
+
+	for (int p = 0; p < n_providers; p++) {
+		struct search *search = &batch->searches[p];
+		if (!search->done) {
+			rpc_abandon(&search->rpc);
+			search->done = true;
+		}
+	}
+}
+
+static void search_complete(struct rpc *rpc, void *data) {
+	(void)rpc;
+
+	struct search *search = data;
+
+	search->r = search_finish(search);
+	if (search->r == 0 && search->n_starved > 0) {
+		log_info("the results of %d files were crowded out, searching them again...", search->n_starved);
+		search->r = search_resend(search);
+		if (search->r == 0 && !search->done)
+			return;
+	}
+	search->done = true;
+	search_decide(search->batch);
+}
+
+/*
+ * searches the first n jobs of a batch (that haven't failed yet and aren't
+ * cached) on every provider at once.
+ */
+static int batch_search_start(struct batch *batch, int n) {
+	batch->n_searched = n;
+	batch->searches = calloc(n_providers, sizeof(struct search));
+	if (!batch->searches)
+		return log_oom();
+
+	// with several providers, they are logged in to at once (instead of by the first search of each)
+	for (int i = 0; n_providers > 1 && i < n; i++) {
+		const struct file_job *job = &batch->jobs[i];
+		if (job->r == 0 && !job->search_cached && !job->stored) {
+			login_all();
+			break;
+		}
+	}
+
+	for (int p = 0; p < n_providers; p++) {
+		struct search *search = &batch->searches[p];
+		search->provider = &providers[p];
+		search->batch = batch;
+		search->rpc.provider = search->provider;
+		search->rpc.hedgeable = true;
+		search->rpc.complete = search_complete;
+		search->rpc.complete_data = search;
+
+		// see rpc_login()
+		if (search->provider->login_r != 0) {
+			search->done = true;
+			search->r = search->provider->login_r;
+			continue;
+		}
+
+		int r = search_start(search, n);
+		if (r != 0) {
+			search->done = true;
+			search->r = r;
+			return r;
+		}
+	}
+
+	return 0;
+}
+
+static void batch_search_clean(struct batch *batch) {
+	for (int p = 0; batch->searches && p < n_providers; p++) {
+		struct search *search = &batch->searches[p];
+
+		rpc_clean(&search->rpc);
+		for (int j = 0; search->results && j < batch->n_searched; j++) {
+			if (search->results[j])
+				xmlrpc_DECREF(search->results[j]);
+			if (search->lang_counts && search->lang_counts[j])
+				g_hash_table_destroy(search->lang_counts[j]);
+		}
+		free(search->results);
+		free(search->hash_matched);
+		free(search->lang_counts);
+		free(search->query_jobs);
+	}
+	free(batch->searches);
+	batch->searches = NULL;
+}
+
+static void print_separator(int c, int digit_count) {
+	for (int i = 0; i < c; i++) {
+		if (i == digit_count + 1 ||
+		    i == digit_count + 1 + 4 ||
+		    i == digit_count + 1 + 4 + 6) {
+			fputs(SEP_CROSS, stdout);
+		}
+		else {
+			fputs(SEP_HORIZONTAL, stdout);
+		}
+	}
+	putchar('\n');
+}
+
+static void print_table(struct sub_info *sub_infos, int n, int align_release_name) {
+	// count number of digits
+	int digit_count = 0;
+	int n_tmp = n;
+	while (n_tmp) {
+		n_tmp /= 10;
+		digit_count++;
+	}
+
+	// header
+	putchar('\n');
+	int c = printf("%-*c " SEP_VERTICAL " %c " SEP_VERTICAL " %s " SEP_VERTICAL " %-*s\n",
+	               digit_count,
+	               HEADER_ID,
+	               HEADER_MATCHED_BY_HASH,
+	               HEADER_LANG,
+	               align_release_name,
+	               HEADER_RELEASE_NAME);
+
+	c -= 5;
+
+	// separator
+	print_separator(c, digit_count);
+
+	// list
+	for (int i = 0; i < n; i++) {
 		printf("%-*i " SEP_VERTICAL " %c " SEP_VERTICAL " %s " SEP_VERTICAL " %-*s\n",
 		       digit_count,
 		       i + 1,
@@ -294,401 +2511,2558 @@ static void print_table(struct sub_info *sub_infos, int n, int align_release_nam
 		       align_release_name,
 		       sub_infos[i].release_name);
 
-		printf("%-*s " SEP_VERTICAL "   " SEP_VERTICAL "     " SEP_VERTICAL " " SEP_UP_RIGHT "%s\n",
-		       digit_count,
-		       "",
-		       sub_infos[i].filename);
+		printf("%-*s " SEP_VERTICAL "   " SEP_VERTICAL "     " SEP_VERTICAL " " SEP_UP_RIGHT "%s\n",
+		       digit_count,
+		       "",
+		       sub_infos[i].filename);
+
+		if (i != n - 1)
+			print_separator(c, digit_count);
+	}
+	putchar('\n');
+}
+
+/*
+ * copies a string field of a struct into an arena. Languages are interned,
+ * there are only a few different ones among thousands of results.
+ */
+static const char *struct_get_chunk_string(xmlrpc_value *s, const char *key, GStringChunk *chunk, bool intern) {
+	_cleanup_free_ const char *str = struct_get_string(s, key);
+	if (!str)
+		return NULL;
+
+	return intern ? g_string_chunk_insert_const(chunk, str) : g_string_chunk_insert(chunk, str);
+}
+
+/*
+ * copies the fields of the search results which are actually used
+ * into the sub_infos of a job, so the (much larger) xmlrpc tree can be
+ * released early.
+ */
+static int read_sub_infos(struct file_job *job) {
+	int n = xmlrpc_array_size(&env, job->results);
+	if (env.fault_occurred) {
+		log_err("failed to get array size: %s (%d)", env.fault_string, env.fault_code);
+		return env_fault();
+	}
+
+	if (n == 0)
+		return 0;
+
+	job->sub_infos = calloc(n, sizeof(struct sub_info));
+	if (!job->sub_infos)
+		return log_oom();
+	job->n_sub_infos = n;
+
+	// large enough for the release and file names of most results at once
+	job->sub_strings = g_string_chunk_new(n * SUB_STRINGS_PER_RESULT);
+
+	for (int i = 0; i < n; i++) {
+		struct sub_info *sub_info = &job->sub_infos[i];
+
+		_cleanup_xmlrpc_ xmlrpc_value *oneresult = NULL;
+		xmlrpc_array_read_item(&env, job->results, i, &oneresult);
+
+		// dear OpenSubtitles.org, why are these IDs provided as strings?
+		_cleanup_free_ const char *sub_id_str = struct_get_string(oneresult, "IDSubtitleFile");
+		_cleanup_free_ const char *matched_by_str = struct_get_string(oneresult, "MatchedBy");
+		_cleanup_free_ const char *size_str = struct_get_string(oneresult, "SubSize");
+
+		sub_info->lang = struct_get_chunk_string(oneresult, "SubLanguageID", job->sub_strings, true);
+		sub_info->release_name = struct_get_chunk_string(oneresult, "MovieReleaseName", job->sub_strings, false);
+		sub_info->filename = struct_get_chunk_string(oneresult, "SubFileName", job->sub_strings, false);
+		if (env.fault_occurred) {
+			log_err("failed to read search result: %s (%d)", env.fault_string, env.fault_code);
+			return env_fault();
+		}
+
+		sub_info->id = strtol(sub_id_str, NULL, 10);
+		sub_info->matched_by_hash = strcmp(matched_by_str, "moviehash") == 0;
+		sub_info->size = strtol(size_str, NULL, 10);
+		sub_info->score = -1;
+	}
+
+	return 0;
+}
+
+static void free_sub_infos(struct file_job *job) {
+	if (job->sub_strings)
+		g_string_chunk_free(job->sub_strings);
+	free(job->sub_infos);
+}
+
+/*
+ * --auto-select: name-based results are ranked by their similarity to
+ * the name of the video. Both are split into tokens, which are classified
+ * as title words, episode marker (S01E02 or 1x02), year, resolution, source,
+ * codec and release group (after the last '-').
+ */
+static const char *find_tag(const struct tag *tags, const char *token) {
+	for (; tags->name; tags++) {
+		if (strcmp(tags->name, token) == 0)
+			return tags->canonical;
+	}
+	return NULL;
+}
+
+static bool has_extension(const char *ext, const char **extensions) {
+	for (; *extensions; extensions++) {
+		if (g_ascii_strcasecmp(ext, *extensions) == 0)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * parses an episode marker, "s01e02" or "1x02".
+ */
+static bool parse_episode(const char *token, int *season, int *episode) {
+	char *end = NULL;
+
+	if (token[0] == 's' && isdigit((unsigned char)token[1])) {
+		*season = strtol(token + 1, &end, 10);
+		if (*end != 'e' || !isdigit((unsigned char)end[1]))
+			return false;
+		*episode = strtol(end + 1, &end, 10);
+		return *end == '\0';
+	}
+
+	if (isdigit((unsigned char)token[0])) {
+		*season = strtol(token, &end, 10);
+		if (*end != 'x' || !isdigit((unsigned char)end[1]) || *season > 99)
+			return false;
+		*episode = strtol(end + 1, &end, 10);
+		return *end == '\0' && *episode < 1000;
+	}
+
+	return false;
+}
+
+static bool parse_year(const char *token, int *year) {
+	if (strlen(token) != 4 || strspn(token, "0123456789") != 4)
+		return false;
+
+	*year = strtol(token, NULL, 10);
+	return *year >= 1900 && *year < 2100;
+}
+
+static int parse_release(const char *name, struct release *release) {
+	memset(release, 0, sizeof(struct release));
+
+	release->buf = strdup(name);
+	if (!release->buf)
+		return log_oom();
+
+	char *buf = release->buf;
+	for (char *c = buf; *c; c++)
+		*c = g_ascii_tolower(*c);
+
+	// strip the extension of files
+	char *ext = strrchr(buf, '.');
+	if (ext && (has_extension(ext + 1, video_extensions) || has_extension(ext + 1, subtitle_extensions)))
+		*ext = '\0';
+
+	// the group is after the last '-', e.g. "...x264-group"
+	char *dash = strrchr(buf, '-');
+	if (dash && dash[1] && !dash[1 + strspn(dash + 1, "abcdefghijklmnopqrstuvwxyz0123456789")])
+		release->group = dash + 1;
+
+	// split into tokens in place
+	const char *tokens[RELEASE_MAX_TOKENS];
+	int n_tokens = 0;
+	for (char *c = buf; *c && n_tokens < RELEASE_MAX_TOKENS; ) {
+		if (!isalnum((unsigned char)*c)) {
+			*c++ = '\0';
+			continue;
+		}
+		tokens[n_tokens++] = c;
+		while (isalnum((unsigned char)*c))
+			c++;
+	}
+
+	bool title = true; // the title ends at the first tag
+	const char *other_words[RELEASE_MAX_TOKENS];
+	int n_other_words = 0;
+	for (int i = 0; i < n_tokens; i++) {
+		const char *token = tokens[i];
+		const char *tag;
+
+		if (token == release->group)
+			continue;
+
+		if (strcmp(token, "web") == 0 && i + 1 < n_tokens && strcmp(tokens[i + 1], "dl") == 0) {
+			release->source = "web";
+			title = false;
+			i++;
+		} else if ((tag = find_tag(resolution_tags, token))) {
+			release->resolution = tag;
+			title = false;
+		} else if ((tag = find_tag(source_tags, token))) {
+			release->source = tag;
+			title = false;
+		} else if ((tag = find_tag(codec_tags, token))) {
+			release->codec = tag;
+			title = false;
+		} else if (!release->episode && parse_episode(token, &release->season, &release->episode)) {
+			title = false;
+		} else if (title && i > 0 && parse_year(token, &release->year)) {
+			title = false;
+		} else if (title) {
+			release->words[release->n_words++] = token;
+		} else {
+			other_words[n_other_words++] = token;
+		}
+	}
+
+	// no tags at all, or the name starts with one: use all words
+	if (release->n_words == 0) {
+		memcpy(release->words, other_words, n_other_words * sizeof(const char *));
+		release->n_words = n_other_words;
+	}
+
+	return 0;
+}
+
+/*
+ * the similarity of the title words (Jaccard index).
+ */
+static double title_similarity(const struct release *a, const struct release *b) {
+	int common = 0;
+	for (int i = 0; i < a->n_words; i++) {
+		for (int j = 0; j < b->n_words; j++) {
+			if (strcmp(a->words[i], b->words[j]) == 0) {
+				common++;
+				break;
+			}
+		}
+	}
+
+	int total = a->n_words + b->n_words - common;
+	return total > 0 ? (double)common / total : 0;
+}
+
+/*
+ * scores a result against the video in percent. Only what's known about
+ * the video counts, a different episode or year rules the result out.
+ */
+static int rank_release(const struct release *video, const struct release *sub) {
+	double score = 0;
+	double max = 0;
+
+	if (video->episode) {
+		if (sub->episode && (sub->season != video->season || sub->episode != video->episode))
+			return 0;
+		max += 20;
+		score += sub->episode ? 20 : 0;
+	}
+
+	max += 50;
+	score += 50 * title_similarity(video, sub);
+
+	if (video->year) {
+		if (sub->year && sub->year != video->year)
+			return 0;
+		max += 10;
+		score += sub->year ? 10 : 0;
+	}
+	if (video->group) {
+		max += 10;
+		score += sub->group && strcmp(sub->group, video->group) == 0 ? 10 : 0;
+	}
+	if (video->source) {
+		max += 5;
+		score += sub->source && strcmp(sub->source, video->source) == 0 ? 5 : 0;
+	}
+	if (video->resolution) {
+		max += 3;
+		score += sub->resolution && strcmp(sub->resolution, video->resolution) == 0 ? 3 : 0;
+	}
+	if (video->codec) {
+		max += 2;
+		score += sub->codec && strcmp(sub->codec, video->codec) == 0 ? 2 : 0;
+	}
+
+	return score * 100 / max + 0.5;
+}
+
+/*
+ * scores all results against the video file name and returns the best
+ * one (1-based) if it is at least auto_select percent similar, 0 otherwise.
+ */
+static int rank_results(const char *filename, struct sub_info *sub_infos, int n) {
+	struct release video;
+	int best = 0;
+	int best_score = -1;
+
+	if (parse_release(filename, &video) != 0)
+		return 0;
+
+	for (int i = 0; i < n; i++) {
+		struct release release_name, sub_filename;
+		if (parse_release(sub_infos[i].release_name, &release_name) != 0)
+			break;
+		if (parse_release(sub_infos[i].filename, &sub_filename) != 0) {
+			free(release_name.buf);
+			break;
+		}
+
+		int a = rank_release(&video, &release_name);
+		int b = rank_release(&video, &sub_filename);
+		sub_infos[i].score = a > b ? a : b;
+		if (sub_infos[i].score > best_score) {
+			best = i + 1;
+			best_score = sub_infos[i].score;
+		}
+
+		free(release_name.buf);
+		free(sub_filename.buf);
+	}
+	free(video.buf);
+
+	if (best_score < auto_select)
+		return 0;
+
+	log_info("selected %s (%d%% similar).", sub_infos[best - 1].filename, best_score);
+	return best;
+}
+
+/*
+ * selects one of the n search results, asking the user if necessary.
+ * The index of the selected result is returned in sel.
+ */
+static int choose_from_results(const char *filename, struct sub_info *sub_infos, int n, int *sel_index) {
+	int sel = 0; // selected list item
+
+	// select first hash match if one exists
+	for (int i = 0; i < n && sel == 0; i++) {
+		if (sub_infos[i].matched_by_hash)
+			sel = i + 1;
+	}
+
+	// otherwise the most similar name-based result, if it's similar enough
+	if (sel == 0 && auto_select > 0)
+		sel = rank_results(filename, sub_infos, n);
+
+	if (never_ask && sel == 0)
+		sel = 1;
+
+	// --json never asks and prints the results itself, -1 means the user has to choose
+	if (json) {
+		*sel_index = sel == 0 || always_ask ? -1 : sel - 1;
+		return 0;
+	}
+
+	/* Make the values in the "Release / File Name" column
+	 * at least as long as the header title itself. */
+	int align_release_name = strlen(HEADER_RELEASE_NAME);
+
+	for (int i = 0; i < n; i++) {
+		int s = strlen(sub_infos[i].release_name);
+		if (s > align_release_name)
+			align_release_name = s;
+
+		s = strlen(sub_infos[i].filename);
+		if (s > align_release_name)
+			align_release_name = s;
+	}
+
+	if (sel == 0 || always_ask) {
+		print_table(sub_infos, n, align_release_name);
+
+		_cleanup_free_ char *line = NULL;
+		size_t len = 0;
+		char *endptr = NULL;
+		do {
+			printf("Choose subtitle [1..%i]: ", n);
+			if (getline(&line, &len, prompt_input ? prompt_input : stdin) == -1)
+				return EIO;
+
+			sel = strtol(line, &endptr, 10);
+		} while (*endptr != '\n' || sel < 1 || sel > n);
+	}
+	else if (!quiet) {
+		print_table(sub_infos, n, align_release_name);
+	}
+
+	*sel_index = sel - 1;
+
+	return 0;
+}
+
+/*
+ * decodes (base64) and decompresses (gzip) a subtitle to file_path.
+ * The base64 data is decoded in chunks directly into the zlib input buffer,
+ * so there is only one pass over it.
+ */
+static int sub_write(const char *sub_base64, size_t sub_base64_len, const char *file_path) {
+	// zlib stuff, see also http://zlib.net/zlib_how.html
+	int z_ret;
+	z_stream z_strm;
+	unsigned char z_out[ZLIB_CHUNK];
+	unsigned char z_in[ZLIB_CHUNK];
+	z_strm.zalloc = Z_NULL;
+	z_strm.zfree = Z_NULL;
+	z_strm.opaque = Z_NULL;
+	z_strm.avail_in = 0;
+	z_strm.next_in = Z_NULL;
+
+	_cleanup_fclose_ FILE *f = NULL;
+	_cleanup_free_ char *tmp_path = tmp_path_for(file_path);
+	int r = 0;
+	gint64 trace_start = trace_now();
+
+	if (!tmp_path)
+		return log_oom();
+
+	/* decode and decompress to a temporary file, which replaces the output
+	 * file once it's complete. An existing file is never written through,
+	 * it might be a hardlink to the store (--store). */
+	f = fopen(tmp_path, "wxe");
+	if (!f) {
+		log_err("failed to open output file %s: %m", tmp_path);
+		return errno;
+	}
+
+	// 16+MAX_WBITS is needed for gzip support
+	z_ret = inflateInit2(&z_strm, 16 + MAX_WBITS);
+	if (z_ret != Z_OK) {
+		log_err("failed to init zlib (%i)", z_ret);
+		unlink(tmp_path);
+		return z_ret;
+	}
+
+	int b64_state = 0;
+	unsigned int b64_save = 0;
+	size_t b64_offset = 0;
+	do {
+		if (b64_offset >= sub_base64_len)
+			break;
+
+		/* write decoded data to z_in. The offset advances by the number
+		 * of characters consumed, glib keeps incomplete quads (and skips
+		 * whitespace and padding) across calls. */
+		size_t b64_len = sub_base64_len - b64_offset;
+		if (b64_len > B64_CHUNK)
+			b64_len = B64_CHUNK;
+
+		z_strm.avail_in = g_base64_decode_step(&sub_base64[b64_offset], b64_len, z_in, &b64_state, &b64_save);
+		b64_offset += b64_len;
+		if (z_strm.avail_in == 0)
+			continue;
+
+		z_strm.next_in = z_in;
+
+		// decompress decoded data from z_in to z_out
+		do {
+			z_strm.avail_out = ZLIB_CHUNK;
+			z_strm.next_out = z_out;
+			z_ret = inflate(&z_strm, Z_NO_FLUSH);
+
+			switch (z_ret) {
+			case Z_NEED_DICT:
+				z_ret = Z_DATA_ERROR;
+				// fallthrough
+			case Z_DATA_ERROR:
+			case Z_MEM_ERROR:
+				r = z_ret;
+				log_err("zlib error: %s (%d)", z_strm.msg, z_ret);
+				goto finish;
+			}
+			// write decompressed data from z_out to file
+			unsigned int have = ZLIB_CHUNK - z_strm.avail_out;
+
+			size_t written = fwrite(z_out, 1, have, f);
+			if (written != have) {
+				log_err("failed to write file: %m");
+				r = errno;
+				goto finish;
+			}
+		} while (z_strm.avail_out == 0);
+	} while (z_ret != Z_STREAM_END);
+
+	if (z_ret != Z_STREAM_END) {
+		log_err("subtitle data for %s is truncated.", file_path);
+		r = Z_DATA_ERROR;
+	}
+
+finish:
+	trace_end(PHASE_DECODE, trace_start, file_path, z_strm.total_out);
+	inflateEnd(&z_strm);
+
+	if (r == 0 && fflush(f) != 0) {
+		log_err("failed to write file: %m");
+		r = errno;
+	}
+	if (r == 0 && rename(tmp_path, file_path) == -1) {
+		log_err("failed to rename %s to %s: %m", tmp_path, file_path);
+		r = errno;
+	}
+	if (r != 0)
+		unlink(tmp_path);
+
+	return r;
+}
+
+/*
+ * marks all jobs of a batch as failed.
+ */
+static void fail_batch(struct batch *batch, int n, int r) {
+	for (int i = 0; i < n; i++) {
+		if (batch->jobs[i].r == 0 && !batch->jobs[i].done)
+			batch->jobs[i].r = r;
+	}
+}
+
+/*
+ * estimates the size of a subtitle in a DownloadSubtitles response:
+ * gzip doesn't grow text, base64 makes it 4/3 as large.
+ */
+static size_t download_size(long sub_size) {
+	if (sub_size <= 0)
+		return DOWNLOAD_SIZE_UNKNOWN;
+	return sub_size / 3 * 4 + 1024;
+}
+
+static void download_rpc_start(struct provider *provider, struct batch *batch, xmlrpc_value *query_array) {
+	struct rpc *rpc = &batch->download_rpcs[batch->n_download_rpcs++];
+
+	rpc->provider = provider;
+	rpc->method = "DownloadSubtitles";
+	rpc->params = xmlrpc_build_value(&env, "(A)", query_array);
+	rpc->with_token = true;
+	rpc_start(rpc);
+}
+
+/*
+ * whether no earlier selection of a batch has the same subtitle of the same
+ * provider, the same subtitle might have been selected for several files.
+ */
+static bool selection_is_first(const struct batch *batch, const struct provider *provider,
+                               const struct selection *selection) {
+	for (int i = 0; i < batch->n; i++) {
+		const struct file_job *job = &batch->jobs[i];
+		if (job->provider != provider)
+			continue;
+
+		for (int k = 0; job->r == 0 && k < job->n_selections; k++) {
+			if (&job->selections[k] == selection)
+				return true;
+			if (job->selections[k].sub_id == selection->sub_id)
+				return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * adds a subtitle to the current DownloadSubtitles call of a batch,
+ * unless it's already requested. The call is sent once it's full.
+ */
+static void sub_download_add(struct provider *provider, struct batch *batch, struct selection *selection,
+                             xmlrpc_value **query_array, size_t *query_size) {
+	if (!selection_is_first(batch, provider, selection))
+		return;
+
+	size_t size = download_size(selection->sub_size);
+	if (*query_array && *query_size + size > DOWNLOAD_SIZE_LIMIT) {
+		download_rpc_start(provider, batch, *query_array);
+		xmlrpc_DECREF(*query_array);
+		*query_array = NULL;
+	}
+
+	if (!*query_array) {
+		*query_array = xmlrpc_array_new(&env);
+		*query_size = 0;
+	}
+
+	_cleanup_xmlrpc_ xmlrpc_value *sub_id_xmlval = xmlrpc_int_new(&env, selection->sub_id);
+	xmlrpc_array_append_item(&env, *query_array, sub_id_xmlval);
+	*query_size += size;
+}
+
+/*
+ * requests the selected subtitles of the first n jobs of a batch (that
+ * haven't failed yet and were found on provider) with as few
+ * DownloadSubtitles calls as possible. The subtitles are split up, so no
+ * response gets larger than DOWNLOAD_SIZE_LIMIT and each one can be
+ * released once it's written.
+ */
+static void sub_download_start(struct provider *provider, struct batch *batch, int n) {
+	_cleanup_xmlrpc_ xmlrpc_value *query_array = NULL;
+	size_t query_size = 0;
+
+	struct file_job *jobs = batch->jobs;
+
+	for (int i = 0; i < n; i++) {
+		if (jobs[i].provider != provider)
+			continue;
+
+		for (int k = 0; jobs[i].r == 0 && k < jobs[i].n_selections; k++) {
+			if (!jobs[i].selections[k].downloaded)
+				sub_download_add(provider, batch, &jobs[i].selections[k], &query_array, &query_size);
+		}
+	}
+
+	if (query_array)
+		download_rpc_start(provider, batch, query_array);
+}
+
+/*
+ * requests the selected subtitles of the first n jobs of a batch,
+ * each from the provider it was found on.
+ */
+static void batch_download_start(struct batch *batch, int n) {
+	struct file_job *jobs = batch->jobs;
+
+	// at most one call per subtitle
+	int n_selections = 0;
+	for (int i = 0; i < n; i++)
+		n_selections += jobs[i].n_selections;
+
+	batch->download_rpcs = calloc(n_selections, sizeof(struct rpc));
+	if (n_selections > 0 && !batch->download_rpcs) {
+		log_oom();
+		fail_batch(batch, n, ENOMEM);
+		return;
+	}
+
+	for (int p = 0; p < n_providers; p++)
+		sub_download_start(&providers[p], batch, n);
+}
+
+static void store_add(const struct file_job *job, const struct selection *selection);
+
+/*
+ * writes the subtitles of one DownloadSubtitles call to the output files
+ * of the first n jobs of a batch.
+ */
+static int sub_download_write(struct rpc *rpc, struct file_job *jobs, int n) {
+	_cleanup_xmlrpc_ xmlrpc_value *data = NULL; // result -> data
+
+	int r = rpc_check(rpc);
+	if (r != 0)
+		return r;
+
+	xmlrpc_struct_read_value(&env, rpc->result, "data", &data);
+	if (env.fault_occurred) {
+		log_err("failed to get data: %s (%d)", env.fault_string, env.fault_code);
+		return env_fault();
+	}
+
+	int data_length = xmlrpc_value_type(data) == XMLRPC_TYPE_ARRAY ? xmlrpc_array_size(&env, data) : 0;
+
+	// get base64 encoded data and write it to every file which selected this subtitle
+	for (int i = 0; i < data_length; i++) {
+		_cleanup_xmlrpc_ xmlrpc_value *data_i = NULL; // result -> data[i]
+		xmlrpc_array_read_item(&env, data, i, &data_i);
+
+		_cleanup_xmlrpc_ xmlrpc_value *sub_base64_xmlval = NULL;
+		_cleanup_free_ const char *sub_id_str = struct_get_string(data_i, "idsubtitlefile");
+		_cleanup_free_ const char *sub_base64 = NULL; // the subtitle, gzipped and base64 encoded
+		size_t sub_base64_len = 0;
+
+		xmlrpc_struct_find_value(&env, data_i, "data", &sub_base64_xmlval);
+		xmlrpc_read_string_lp(&env, sub_base64_xmlval, &sub_base64_len, &sub_base64);
+		if (env.fault_occurred) {
+			log_err("failed to get data: %s (%d)", env.fault_string, env.fault_code);
+			return env_fault();
+		}
+
+		int sub_id = strtol(sub_id_str, NULL, 10);
+		for (int j = 0; j < n; j++) {
+			if (jobs[j].provider != rpc->provider)
+				continue;
+
+			for (int k = 0; jobs[j].r == 0 && k < jobs[j].n_selections; k++) {
+				struct selection *selection = &jobs[j].selections[k];
+				if (selection->sub_id != sub_id || selection->downloaded)
+					continue;
+
+				// the bytes of the call are counted once, on its first span
+				trace_job(&jobs[j], PHASE_DOWNLOAD, rpc->first_started, rpc->finished, rpc->bytes);
+				rpc->bytes = 0;
+				log_info("downloading to %s ...", selection->sub_filepath);
+
+				// sub_write() records the span itself
+				gint64 decode_start = trace_now();
+				jobs[j].r = sub_write(sub_base64, sub_base64_len, selection->sub_filepath);
+				if (timing)
+					jobs[j].timings[PHASE_DECODE] += g_get_monotonic_time() - decode_start;
+				selection->downloaded = true;
+
+				if (jobs[j].r == 0)
+					store_add(&jobs[j], selection);
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * marks those of the first n jobs of a batch as failed which still wait
+ * for a subtitle requested by a failed DownloadSubtitles call. Jobs whose
+ * subtitles came with other calls (or were written before it failed)
+ * aren't affected.
+ */
+static void fail_download(struct rpc *rpc, struct file_job *jobs, int n, int r) {
+	_cleanup_xmlrpc_ xmlrpc_value *ids = NULL; // params[0]
+
+	if (!rpc->params)
+		return;
+
+	xmlrpc_array_read_item(&env, rpc->params, 0, &ids);
+	int n_ids = env.fault_occurred ? 0 : xmlrpc_array_size(&env, ids);
+
+	for (int i = 0; i < n_ids && !env.fault_occurred; i++) {
+		_cleanup_xmlrpc_ xmlrpc_value *id_xmlval = NULL;
+		int sub_id = 0;
+
+		xmlrpc_array_read_item(&env, ids, i, &id_xmlval);
+		xmlrpc_read_int(&env, id_xmlval, &sub_id);
+		if (env.fault_occurred)
+			break;
+
+		for (int j = 0; j < n; j++) {
+			if (jobs[j].provider != rpc->provider)
+				continue;
+
+			for (int k = 0; jobs[j].r == 0 && k < jobs[j].n_selections; k++) {
+				if (jobs[j].selections[k].sub_id == sub_id && !jobs[j].selections[k].downloaded)
+					jobs[j].r = r;
+			}
+		}
+	}
+
+	// the jobs which couldn't be matched fail below for lack of data
+	if (env.fault_occurred)
+		env_fault();
+}
+
+/*
+ * writes the subtitles of the DownloadSubtitles calls of a batch
+ * to the output files of the first n jobs. A failed call only fails
+ * the jobs waiting for its subtitles.
+ */
+static void sub_download_finish(struct batch *batch, int n) {
+	struct file_job *jobs = batch->jobs;
+
+	for (int i = 0; i < batch->n_download_rpcs; i++) {
+		struct rpc *rpc = &batch->download_rpcs[i];
+		int r = sub_download_write(rpc, jobs, n);
+		if (r != 0)
+			fail_download(rpc, jobs, n, r);
+
+		// the response isn't needed anymore
+		rpc_clean(rpc);
+	}
+
+	for (int i = 0; i < n; i++) {
+		for (int k = 0; jobs[i].r == 0 && k < jobs[i].n_selections; k++) {
+			if (!jobs[i].selections[k].downloaded) {
+				log_err("no data for subtitle %i.", jobs[i].selections[k].sub_id);
+				jobs[i].r = 1;
+			}
+		}
+	}
+}
+
+static void show_usage() {
+	puts("Usage: subberthehut [options] <file>...\n\n"
+
+	     "OpenSubtitles.org downloader.\n\n"
+
+	     "subberthehut can do a hash-based and a name-based search.\n"
+	     "On a hash-based search, subberthehut will generate a hash from the specified\n"
+	     "video file and use this to search for appropriate subtitles.\n"
+	     "Any results from this hash-based search should be compatible\n"
+	     "with the video file. Therefore subberthehut will, by default, automatically\n"
+	     "download the first subtitle from these search results.\n"
+	     "In case the hash-based search returns no results, subberthehut will also\n"
+	     "do a name-based search, meaning the OpenSubtitles.org database\n"
+	     "will be searched with the filename of the specified file. The results\n"
+	     "from this search are not guaranteed to be compatible with the video\n"
+	     "file. Therefore subberthehut will, by default, ask the user which subtitle to\n"
+	     "download.\n"
+	     "Results from the hash-based search are marked with an asterisk (*)\n"
+	     "in the 'H' column.\n");
+
+	// split up, ISO C99 only requires support for 4095 characters in a string literal
+	puts("Options:\n"
+	     " -h, --help              Show this help and exit.\n"
+	     "\n"
+	     " -v, --version           Show version information and exit.\n"
+	     "\n"
+	     " -l, --lang <languages>  Comma-separated list of languages to search for,\n"
+	     "                         e.g. 'eng,ger'. Use 'all' to search for all\n"
+	     "                         languages. Default is 'eng'. Use --list-languages\n"
+	     "                         to list all available languages. Two-letter codes\n"
+	     "                         like 'en,de' are accepted, too.\n"
+	     "\n"
+	     " -L, --list-languages    List all available languages and exit.\n"
+	     "\n"
+	     " -a, --always-ask        Always ask which subtitle to download, even\n"
+	     "                         when there are hash-based results.\n"
+	     "\n"
+	     " -n, --never-ask         Never ask which subtitle to download, even\n"
+	     "                         when there are only name-based results.\n"
+	     "                         When this option is specified, the first\n"
+	     "                         search result will be downloaded.\n"
+	     "\n"
+	     " -f, --force             Overwrite output file if it already exists.\n"
+	     "\n"
+	     " -o, --hash-search-only  Only do a hash-based search.\n"
+	     "\n"
+	     " -O, --name-search-only  Only do a name-based search. This is useful in\n"
+	     "                         case of false positives from the hash-based search.\n"
+	     "\n"
+	     " -s, --same-name         Download the subtitle to the same filename as the\n"
+	     "                         original file, only replacing the file extension.\n"
+	     "\n"
+	     " -t, --limit <number>    Limits the number of returned results, per language\n"
+	     "                         with --per-language. The default is 10. The server\n"
+	     "                         returns at most 500 results per request.\n");
+
+	puts(" -b, --batch <number>    Search for up to <number> files with a single request.\n"
+	     "                         All files of a batch are hashed before searching.\n"
+	     "                         The default is 1.\n"
+	     "\n"
+	     " -j, --jobs <number>     Keep up to <number> requests in flight at once.\n"
+	     "                         Results are still printed in order. The default is 1.\n"
+	     "\n"
+	     " -H, --hash-threads <number>\n"
+	     "                         Hash up to <number> files at once, while waiting for\n"
+	     "                         the server. The default is 4.\n"
+	     "\n"
+	     " -C, --hash-cache <type> Where to remember the hashes of unchanged files:\n"
+	     "                         'file' (in $XDG_CACHE_HOME/subberthehut/hashes),\n"
+	     "                         'xattr' (in an extended attribute of the file)\n"
+	     "                         or 'none'. The default is 'none'.\n"
+	     "\n"
+	     " --hash-cache-size <number>\n"
+	     "                         Let the hash cache file (-C file) grow to at most\n"
+	     "                         <number> entries (56 bytes each), rounded down to\n"
+	     "                         a power of two. Beyond that, older entries are\n"
+	     "                         replaced.\n"
+	     "                         It starts with 65536, which is also the minimum.\n"
+	     "                         The default is 1048576.\n"
+	     "\n"
+	     " --search-cache-ttl <seconds>\n"
+	     "                         Reuse the search results of a file for <seconds>\n"
+	     "                         if it is searched for again with the same options.\n"
+	     "                         The default is 0, which disables the cache, so\n"
+	     "                         new uploads are found right away.\n"
+	     "\n"
+	     " --search-cache-size <number>\n"
+	     "                         Keep at most <number> cached search results.\n"
+	     "                         The default is 10000.\n"
+	     "\n"
+	     " -r, --recursive         Search directories passed as <file> recursively for\n"
+	     "                         videos. Videos with a subtitle of the same name\n"
+	     "                         next to them are skipped, unless -f is given.\n"
+	     "\n"
+	     " -F, --files-from <file> Read the files to process from <file>, one per line.\n"
+	     "                         Use '-' to read from standard input. The files are\n"
+	     "                         read while processing, so the list can be of any length.\n"
+	     "\n"
+	     " -0, --null              The files in --files-from are separated by NUL\n"
+	     "                         characters instead of newlines, e.g. from 'find -print0'.\n"
+	     "\n"
+	     " -w, --watch             Treat the <file>s as directories and wait for new\n"
+	     "                         videos in them (and their subdirectories with -r),\n"
+	     "                         which are processed once they are completely written.\n"
+	     "                         Runs until interrupted. Combine with -n to never ask.\n"
+	     "                         A video which fails doesn't stop the others (-e).\n");
+
+	puts(" --auto-select <percent>\n"
+	     "                         If there are only name-based results, download the one\n"
+	     "                         most similar to the file name without asking, if it is\n"
+	     "                         at least <percent> similar. Title, episode, year, release\n"
+	     "                         group, source, resolution and codec are compared.\n"
+	     "\n"
+	     " --per-language          Download the best subtitle of every language passed to\n"
+	     "                         -l instead of only one, named like the file with the\n"
+	     "                         language before the extension, e.g. movie.eng.srt.\n"
+	     "                         The best one is a hash match, otherwise chosen by\n"
+	     "                         --auto-select or the first one with -n.\n"
+	     "\n"
+	     " --store <dir>           Keep the subtitles of hash matches in <dir>, which can be\n"
+	     "                         shared between machines, and take them from there\n"
+	     "                         instead of searching the next time. Each subtitle is\n"
+	     "                         stored once and hardlinked next to the videos if\n"
+	     "                         possible.\n"
+	     "\n"
+	     " --url <url>             The XML-RPC endpoint to use, e.g. a local test server.\n"
+	     "                         The default is " STH_XMLRPC_URL ".\n"
+	     "                         Can be passed several times: every file is searched on\n"
+	     "                         all of them at once and takes the first hash match,\n"
+	     "                         otherwise the results of the first server with any.\n"
+	     "\n"
+	     " --json                  Print one JSON object per line for every processed file,\n"
+	     "                         with the results, the selected subtitle, the output file,\n"
+	     "                         the status and the time spent. Never asks: the status is\n"
+	     "                         'needs-choice' if the user would have been asked.\n"
+	     "                         Each line is printed once the file and those before it\n"
+	     "                         are done.\n"
+	     "\n"
+	     " --rate <requests>[/<seconds>]\n"
+	     "                         Send at most <requests> requests per <seconds> (default 1)\n"
+	     "                         to stay below the limit of the server. 0 disables the\n"
+	     "                         limit. The default is 40/10.\n"
+	     "\n"
+	     " --retries <number>      Retry requests which failed because of network errors or\n"
+	     "                         an overloaded server up to <number> times, waiting longer\n"
+	     "                         each time, at most 100. The default is 3.\n"
+	     "\n"
+	     " --hedge <percentile>    If a search hasn't been answered after the <percentile>th\n"
+	     "                         percentile of the recent search latencies of the server,\n"
+	     "                         send it again and take whichever response comes first.\n"
+	     "                         The duplicates count against --jobs, so this needs\n"
+	     "                         --jobs 2 or more.\n"
+	     "\n"
+	     " --hedge-budget <percent>\n"
+	     "                         Send at most <percent> of all requests again because of\n"
+	     "                         --hedge. The default is 5.\n"
+	     "\n"
+	     " --trace <file>          Write the time spent on hashing, logging in, searching,\n"
+	     "                         downloading and decoding for every file to <file>,\n"
+	     "                         as Chrome trace events (see chrome://tracing).\n"
+	     "\n"
+	     " --stats                 Print the 50th, 95th and 99th percentile of the time\n"
+	     "                         spent on each of these phases at exit.\n"
+	     "\n"
+	     " -e, --no-exit-on-fail   By default, subberthehut will exit immediately if\n"
+	     "                         multiple files are passed and it fails to download\n"
+	     "                         a subtitle for one them. When this option is passed,\n"
+	     "                         subberthehut will process the next file(s) regardless.\n"
+	     "\n"
+	     " -q, --quiet             Don't print the table if the user doesn't have to be\n"
+	     "                         asked which subtitle to download. Pass this option twice\n"
+	     "                         to suppress anything but warnings and error messages.\n");
+}
+
+static void show_version() {
+	puts("subberthehut " VERSION "\n"
+	     "https://github.com/mus65/subberthehut/");
+}
+
+/*
+ * checks if a subtitle file already exists, which is only fine with -f.
+ */
+static int check_sub_path(const char *sub_filepath) {
+	if (access(sub_filepath, F_OK) == 0) {
+		if (force_overwrite) {
+			log_info("%s already exists, overwriting.", sub_filepath);
+		} else {
+			log_err("%s already exists, aborting. Use -f to force an overwrite.", sub_filepath);
+			return EEXIST;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * returns the comma-separated languages of -l as the SubLanguageIDs of the
+ * server, lowercase and with the aliases of lang_tags mapped, so they can
+ * be compared with the languages of results and the names of subtitles.
+ */
+static char *normalize_langs(const char *langs) {
+	gchar **l = g_strsplit(langs, ",", -1);
+	for (gchar **c = l; *c; c++) {
+		for (char *p = *c; *p; p++)
+			*p = g_ascii_tolower(*p);
+
+		for (const struct tag *t = lang_tags; t->name; t++) {
+			if (strcmp(*c, t->name) == 0) {
+				g_free(*c);
+				*c = g_strdup(t->canonical);
+				break;
+			}
+		}
+	}
+
+	char *normalized = g_strjoinv(",", l);
+	g_strfreev(l);
+	return normalized;
+}
+
+/*
+ * the path of a subtitle next to the video. With a language (--per-language)
+ * it's always named like the video, with the language before the extension,
+ * e.g. "movie.eng.srt".
+ */
+static const char *get_sub_path(const char *filepath, const char *sub_filename, const char *sub_lang) {
+	char *sub_filepath;
+
+	if (same_name || sub_lang) {
+		const char *sub_ext = strrchr(sub_filename, '.');
+		if (!sub_ext) {
+			log_err("warning: subtitle filename from the OpenSubtitles.org "
+			        "database has no file extension, assuming .srt.");
+			sub_ext = ".srt";
+		}
+		const char *lastdot = strrchr(filepath, '.');
+		int index;
+		if (!lastdot)
+			index = strlen(filepath) - 1;
+		else
+			index = (lastdot - filepath);
+
+		sub_filepath = malloc(index + 1 + (sub_lang ? strlen(sub_lang) + 1 : 0) + strlen(sub_ext) + 1);
+		if (!sub_filepath)
+			return NULL;
+
+		strncpy(sub_filepath, filepath, index);
+		sub_filepath[index] = '\0';
+		if (sub_lang) {
+			strcat(sub_filepath, ".");
+			strcat(sub_filepath, sub_lang);
+		}
+		strcat(sub_filepath, sub_ext);
+	} else {
+		const char *lastslash = strrchr(filepath, '/');
+		if (!lastslash) {
+			sub_filepath = strdup(sub_filename);
+			if (!sub_filepath)
+				return NULL;
+		} else {
+			int index = (lastslash - filepath);
+			sub_filepath = malloc(index + 1 + strlen(sub_filename) + 1);
+			if (!sub_filepath)
+				return NULL;
+
+			strncpy(sub_filepath, filepath, index + 1);
+			sub_filepath[index + 1] = '\0';
+			strcat(sub_filepath, sub_filename);
+		}
+	}
+	return sub_filepath;
+}
+
+/*
+ * --store: subtitles of hash matches, kept in a directory which can be shared
+ * between machines:
+ *
+ *   <dir>/index/<moviehash>/<lang>    "<checksum> <subtitle file name>\n"
+ *   <dir>/blobs/<xx>/<checksum>       the subtitle, xx are the first two digits
+ *
+ * The checksum is the SHA-256 of the subtitle, so every subtitle is kept once.
+ * Files are written under a temporary name and renamed, so other processes
+ * never see partial files. A blob is a copy (or reflink) of a downloaded
+ * subtitle, never a link to it, and it's placed next to the videos as a
+ * hardlink. sub_write() replaces files instead of writing through them, so
+ * a blob only changes if a user edits one of its links in place; it is
+ * verified before it's used and replaced by the next download then.
+ */
+struct store_entry {
+	char checksum[STORE_CHECKSUM_LEN + 1];
+	char *sub_filename;
+	char *lang;
+};
+
+/*
+ * the hex SHA-256 of a file, out must hold STORE_CHECKSUM_LEN + 1 bytes.
+ */
+static int store_checksum(const char *path, char *out) {
+	_cleanup_close_ int fd = open(path, O_RDONLY | O_CLOEXEC);
+	unsigned char buf[ZLIB_CHUNK];
+	ssize_t n;
+
+	if (fd == -1)
+		return errno;
+
+	GChecksum *checksum = g_checksum_new(G_CHECKSUM_SHA256);
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		g_checksum_update(checksum, buf, n);
+	if (n == 0)
+		snprintf(out, STORE_CHECKSUM_LEN + 1, "%s", g_checksum_get_string(checksum));
+	g_checksum_free(checksum);
+
+	return n == 0 ? 0 : errno;
+}
+
+static int store_copy(int src_fd, int dst_fd) {
+	char buf[ZLIB_CHUNK];
+	ssize_t n;
+
+#ifdef FICLONE
+	// shares the blocks on filesystems which support it (btrfs, xfs)
+	if (ioctl(dst_fd, FICLONE, src_fd) == 0)
+		return 0;
+#endif
+
+	while ((n = read(src_fd, buf, sizeof(buf))) > 0) {
+		if (write(dst_fd, buf, n) != n)
+			return errno ? errno : EIO;
+	}
+	return n == 0 ? 0 : errno;
+}
+
+/*
+ * copies the file src to dst, which must not exist, as a reflink if possible.
+ */
+static int store_clone(const char *src, const char *dst, mode_t mode) {
+	_cleanup_close_ int src_fd = open(src, O_RDONLY | O_CLOEXEC);
+	if (src_fd == -1)
+		return errno;
+
+	_cleanup_close_ int dst_fd = open(dst, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+	if (dst_fd == -1)
+		return errno;
+
+	int r = store_copy(src_fd, dst_fd);
+	if (r != 0)
+		unlink(dst);
+	return r;
+}
+
+/*
+ * places the file src at dst, which must not exist: as a hardlink if
+ * possible, otherwise as a reflink or a copy.
+ */
+static int store_place(const char *src, const char *dst) {
+	if (link(src, dst) == 0)
+		return 0;
+	if (errno == EEXIST)
+		return EEXIST;
+
+	return store_clone(src, dst, 0644);
+}
+
+static char *store_blob_path(const char *checksum) {
+	char *path = NULL;
+	if (asprintf(&path, "%s/blobs/%.2s/%s", store_dir, checksum, checksum) == -1)
+		return NULL;
+	return path;
+}
+
+/*
+ * reads the index entry of a language of a job, returns false if there is none.
+ */
+static bool store_read_entry(const struct file_job *job, const char *sub_lang, struct store_entry *entry) {
+	_cleanup_free_ char *path = NULL;
+	_cleanup_fclose_ FILE *f = NULL;
+	_cleanup_free_ char *line = NULL;
+	size_t len = 0;
+
+	if (asprintf(&path, "%s/index/%016" PRIx64 "/%s", store_dir, job->hash, sub_lang) == -1)
+		return false;
+
+	f = fopen(path, "re");
+	if (!f)
+		return false;
+
+	ssize_t n = getline(&line, &len, f);
+	if (n <= 0)
+		return false;
+	if (line[n - 1] == '\n')
+		line[n - 1] = '\0';
+
+	// the store may be shared, don't let an entry point anywhere else
+	char *space = strchr(line, ' ');
+	if (!space || space - line != STORE_CHECKSUM_LEN || !space[1] || strchr(space + 1, '/'))
+		return false;
+	for (int i = 0; i < STORE_CHECKSUM_LEN; i++) {
+		if (!g_ascii_isxdigit(line[i]))
+			return false;
+	}
+
+	memcpy(entry->checksum, line, STORE_CHECKSUM_LEN);
+	entry->checksum[STORE_CHECKSUM_LEN] = '\0';
+	entry->sub_filename = strdup(space + 1);
+	entry->lang = strdup(sub_lang);
+	if (!entry->sub_filename || !entry->lang) {
+		free(entry->sub_filename);
+		free(entry->lang);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * places the subtitles of a job from the store, before anything is searched.
+ * Without --per-language, the first language of -l in the store is taken,
+ * otherwise every language has to be in the store ("all" is never complete).
+ * Sets job->stored if the job is done.
+ */
+static int store_lookup(struct file_job *job) {
+	_cleanup_free_ struct store_entry *entries = NULL;
+	int n_entries = 0;
+	int r = 0;
+
+	if (!store_dir || name_search_only || always_ask)
+		return 0;
+
+	if (strcmp(lang, "all") == 0 && per_language)
+		return 0;
+
+	gchar **langs;
+	if (strcmp(lang, "all") == 0) {
+		_cleanup_free_ char *dir_path = NULL;
+		if (asprintf(&dir_path, "%s/index/%016" PRIx64, store_dir, job->hash) == -1)
+			return log_oom();
+
+		GPtrArray *names = g_ptr_array_new();
+		DIR *dir = opendir(dir_path);
+		struct dirent *de;
+		while (dir && (de = readdir(dir))) {
+			if (de->d_name[0] != '.')
+				g_ptr_array_add(names, g_strdup(de->d_name));
+		}
+		if (dir)
+			closedir(dir);
+		g_ptr_array_sort(names, compare_strings);
+		g_ptr_array_add(names, NULL);
+		langs = (gchar **)g_ptr_array_free(names, FALSE);
+	} else {
+		langs = g_strsplit(lang, ",", -1);
+	}
+
+	entries = calloc(g_strv_length(langs) + 1, sizeof(struct store_entry));
+	if (!entries) {
+		g_strfreev(langs);
+		return log_oom();
+	}
+
+	bool complete = true;
+	for (gchar **l = langs; *l; l++) {
+		for (char *c = *l; *c; c++)
+			*c = g_ascii_tolower(*c);
+
+		if (store_read_entry(job, *l, &entries[n_entries])) {
+			n_entries++;
+			if (!per_language)
+				break;
+		} else {
+			complete = false;
+		}
+	}
+	g_strfreev(langs);
+
+	// a missing language is searched anyway, the store can't save anything then
+	if (n_entries == 0 || (per_language && !complete))
+		goto finish;
+
+	// a blob which was changed through one of its hardlinks isn't used, see store_add()
+	for (int i = 0; i < n_entries; i++) {
+		_cleanup_free_ char *blob_path = store_blob_path(entries[i].checksum);
+		char checksum[STORE_CHECKSUM_LEN + 1];
+
+		if (!blob_path) {
+			r = log_oom();
+			goto finish;
+		}
+
+		if (store_checksum(blob_path, checksum) != 0 || strcmp(checksum, entries[i].checksum) != 0) {
+			log_err("warning: %s is missing or damaged, ignoring the store.", blob_path);
+			goto finish;
+		}
+	}
+
+	job->selections = calloc(n_entries, sizeof(struct selection));
+	if (!job->selections) {
+		r = log_oom();
+		goto finish;
+	}
+
+	for (int i = 0; i < n_entries; i++) {
+		struct selection *selection = &job->selections[job->n_selections++];
+		_cleanup_free_ char *blob_path = store_blob_path(entries[i].checksum);
+
+		selection->sub_filepath = get_sub_path(job->filepath, entries[i].sub_filename, per_language ? entries[i].lang : NULL);
+		if (!blob_path || !selection->sub_filepath) {
+			r = log_oom();
+			goto finish;
+		}
+
+		r = check_sub_path(selection->sub_filepath);
+		if (r != 0)
+			goto finish;
+
+		unlink(selection->sub_filepath);
+		r = store_place(blob_path, selection->sub_filepath);
+		if (r != 0) {
+			log_err("failed to place %s at %s: %s", blob_path, selection->sub_filepath, strerror(r));
+			goto finish;
+		}
+
+		log_info("%s taken from the store.", selection->sub_filepath);
+		selection->downloaded = true;
+	}
+
+	job->stored = true;
+
+finish:
+	for (int i = 0; i < n_entries; i++) {
+		free(entries[i].sub_filename);
+		free(entries[i].lang);
+	}
+	return r;
+}
+
+/*
+ * adds a downloaded subtitle of a hash match to the store. Failures are
+ * only warnings, the subtitle itself is there.
+ */
+static void store_add(const struct file_job *job, const struct selection *selection) {
+	_cleanup_free_ char *blob_path = NULL;
+	_cleanup_free_ char *blob_dir = NULL;
+	_cleanup_free_ char *tmp_path = NULL;
+	_cleanup_free_ char *index_dir = NULL;
+	_cleanup_free_ char *index_path = NULL;
+	_cleanup_free_ char *index_tmp_path = NULL;
+	_cleanup_free_ char *content = NULL;
+	char checksum[STORE_CHECKSUM_LEN + 1];
+	char blob_checksum[STORE_CHECKSUM_LEN + 1];
+	int r;
+
+	if (!store_dir || !selection->matched_by_hash || name_search_only || !selection->sub_filename)
+		return;
+
+	r = store_checksum(selection->sub_filepath, checksum);
+	if (r != 0) {
+		log_err("warning: failed to read %s: %s", selection->sub_filepath, strerror(r));
+		return;
+	}
+
+	// the name on the server, not the one of the output file (-s, --per-language)
+	const char *sub_filename = strrchr(selection->sub_filename, '/');
+	sub_filename = sub_filename ? sub_filename + 1 : selection->sub_filename;
+
+	// the language comes from the server, it's a file name here
+	if (strchr(selection->lang, '/') || selection->lang[0] == '.' || !*sub_filename || strchr(sub_filename, '\n'))
+		return;
+
+	blob_path = store_blob_path(checksum);
+	if (!blob_path || !(blob_dir = strdup(blob_path)) ||
+	    asprintf(&index_dir, "%s/index/%016" PRIx64, store_dir, job->hash) == -1 ||
+	    asprintf(&index_path, "%s/%s", index_dir, selection->lang) == -1 ||
+	    asprintf(&content, "%s %s\n", checksum, sub_filename) == -1) {
+		log_oom();
+		return;
+	}
+	*strrchr(blob_dir, '/') = '\0';
+
+	if (g_mkdir_with_parents(blob_dir, 0755) == -1 || g_mkdir_with_parents(index_dir, 0755) == -1) {
+		log_err("warning: failed to create the directories of %s: %m", store_dir);
+		return;
+	}
+
+	/* the same subtitle might be there already, from another file or machine.
+	 * A blob which doesn't match its checksum (anymore) is replaced. */
+	if (store_checksum(blob_path, blob_checksum) != 0 || strcmp(blob_checksum, checksum) != 0) {
+		tmp_path = tmp_path_for(blob_path);
+		if (!tmp_path) {
+			log_oom();
+			return;
+		}
+
+		// read-only, the blob is hardlinked next to the videos
+		r = store_clone(selection->sub_filepath, tmp_path, 0444);
+		if (r == 0 && rename(tmp_path, blob_path) == -1)
+			r = errno;
+		if (r != 0) {
+			log_err("warning: failed to add %s to the store: %s", selection->sub_filepath, strerror(r));
+			unlink(tmp_path);
+			return;
+		}
+	}
+
+	index_tmp_path = tmp_path_for(index_path);
+	if (!index_tmp_path) {
+		log_oom();
+		return;
+	}
+
+	if (!g_file_set_contents(index_tmp_path, content, -1, NULL) || rename(index_tmp_path, index_path) == -1) {
+		log_err("warning: failed to add %s to the store index.", selection->sub_filepath);
+		unlink(index_tmp_path);
+	}
+}
+
+/*
+ * recursive library scan: every directory below a directory passed on the
+ * command line, at any depth, is read by a task of the scan pool, and the
+ * videos are handed to the hashing threads as soon as they are found.
+ * Directories are opened relative to their parent (openat), entries are
+ * sorted by name, so the resulting order is the same as for a sequential
+ * walk.
+ */
+static bool is_video(const char *name) {
+	const char *ext = strrchr(name, '.');
+	if (!ext)
+		return false;
+
+	for (const char **v = video_extensions; *v; v++) {
+		if (g_ascii_strcasecmp(ext + 1, *v) == 0)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * checks whether a subtitle with the base name base and one of the
+ * subtitle extensions exists in dir_fd.
+ */
+static bool has_subtitle_named(int dir_fd, const char *base) {
+	for (const char **e = subtitle_extensions; *e; e++) {
+		_cleanup_free_ char *sub_name = NULL;
+		if (asprintf(&sub_name, "%s.%s", base, *e) == -1)
+			return false;
+		if (faccessat(dir_fd, sub_name, F_OK, 0) == 0)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * checks whether a subtitle with the same base name as the video exists
+ * next to it. The name of the subtitle on the server isn't known before
+ * searching, so this is the target of --same-name for any subtitle format.
+ * With --per-language, the video needs one for each language of -l instead,
+ * named like "movie.eng.srt".
+ */
+static bool has_subtitle(int dir_fd, const char *name) {
+	_cleanup_free_ char *base = strdup(name);
+	if (!base)
+		return false;
+
+	*strrchr(base, '.') = '\0';
+
+	if (!per_language || strcmp(lang, "all") == 0)
+		return has_subtitle_named(dir_fd, base);
+
+	gchar **langs = g_strsplit(lang, ",", -1);
+	bool found = true;
+	for (gchar **l = langs; *l && found; l++) {
+		_cleanup_free_ char *lang_base = NULL;
+		if (asprintf(&lang_base, "%s.%s", base, *l) == -1)
+			found = false;
+		else
+			found = has_subtitle_named(dir_fd, lang_base);
+	}
+	g_strfreev(langs);
+	return found;
+}
+
+/*
+ * directory entries are stored as the d_type followed by the name,
+ * so they can be sorted by name and keep their type.
+ */
+static int compare_entries(const void *a, const void *b) {
+	return strcmp(*(char * const *)a + 1, *(char * const *)b + 1);
+}
+
+/*
+ * returns the sorted entries of the directory fd.
+ */
+static GPtrArray *read_dir_entries(int fd, const char *path) {
+	// closedir() closes the descriptor, but the caller still needs it
+	int dir_fd = dup(fd);
+	DIR *dir = dir_fd != -1 ? fdopendir(dir_fd) : NULL;
+	if (!dir) {
+		log_err("warning: failed to read directory %s: %m", path);
+		if (dir_fd != -1)
+			close(dir_fd);
+		return NULL;
+	}
+
+	GPtrArray *entries = g_ptr_array_new_with_free_func(free);
+	struct dirent *de;
+	while ((de = readdir(dir))) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+
+		char *entry = malloc(1 + strlen(de->d_name) + 1);
+		if (!entry) {
+			log_oom();
+			break;
+		}
+		entry[0] = de->d_type;
+		strcpy(entry + 1, de->d_name);
+		g_ptr_array_add(entries, entry);
+	}
+	closedir(dir);
+
+	qsort(entries->pdata, entries->len, sizeof(char *), compare_entries);
+
+	return entries;
+}
+
+/*
+ * returns the type of a directory entry: DT_DIR, DT_REG or DT_UNKNOWN
+ * for anything else. Symlinks to files are followed, but not those to
+ * directories.
+ */
+static unsigned char entry_type(int dir_fd, const char *name, unsigned char type) {
+	if (type == DT_UNKNOWN || type == DT_LNK) {
+		struct stat st;
+		if (fstatat(dir_fd, name, &st, 0) == -1 || (type == DT_LNK && S_ISDIR(st.st_mode)))
+			return DT_UNKNOWN;
+		return S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+	}
+	return type == DT_DIR || type == DT_REG ? type : DT_UNKNOWN;
+}
+
+static struct scan_dir *scan_dir_new(struct scan_dir *parent, const char *name, char *path) {
+	struct scan_dir *dir = g_new0(struct scan_dir, 1);
+	dir->parent = parent;
+	dir->name = g_strdup(name);
+	dir->path = path;
+	dir->fd = -1;
+	return dir;
+}
+
+/*
+ * frees dir and whatever of it hasn't been returned yet.
+ */
+static void scan_dir_free(struct scan_dir *dir) {
+	for (guint i = 0; dir->entries && i < dir->entries->len; i++) {
+		struct scan_entry *e = &g_array_index(dir->entries, struct scan_entry, i);
+		free(e->path);
+		if (e->dir)
+			scan_dir_free(e->dir);
+	}
+	if (dir->entries)
+		g_array_free(dir->entries, TRUE);
+	if (dir->fd != -1)
+		close(dir->fd);
+	g_free(dir->name);
+	free(dir->path);
+	g_free(dir);
+}
+
+/*
+ * reads the entries of a directory in one of the scan threads and
+ * queues its subdirectories, so every level of the tree is read in
+ * parallel, not just the top one.
+ */
+static void scan_dir_run(gpointer data, gpointer user_data) {
+	struct scan_dir *dir = data;
+	struct scan *scan = user_data;
+	struct scan_dir *parent = dir->parent;
+
+	// the parent's fd stays open until all of its subdirectories are opened
+	int fd = openat(parent ? parent->fd : AT_FDCWD, parent ? dir->name : dir->path,
+	                O_RDONLY | O_DIRECTORY | (parent ? O_NOFOLLOW : 0) | O_CLOEXEC);
+	if (fd == -1 && !parent)
+		log_err("warning: failed to open directory %s: %m", dir->path);
+	GPtrArray *names = fd != -1 ? read_dir_entries(fd, dir->path) : NULL;
+
+	GArray *entries = g_array_new(FALSE, FALSE, sizeof(struct scan_entry));
+	unsigned found = 0;
+
+	// strip trailing slashes, so the paths look nice
+	size_t prefix_len = strlen(dir->path);
+	while (prefix_len > 0 && dir->path[prefix_len - 1] == '/')
+		prefix_len--;
+
+	for (guint i = 0; names && i < names->len; i++) {
+		const char *name = (const char *)g_ptr_array_index(names, i) + 1;
+		unsigned char type = entry_type(fd, name, ((const char *)g_ptr_array_index(names, i))[0]);
+
+		if (type == DT_REG && (!is_video(name) || (!force_overwrite && has_subtitle(fd, name))))
+			continue;
+		if (type == DT_UNKNOWN)
+			continue;
+
+		char *path = NULL;
+		if (asprintf(&path, "%.*s/%s", (int)prefix_len, dir->path, name) == -1) {
+			log_oom();
+			break;
+		}
+
+		struct scan_entry e = { 0 };
+		if (type == DT_DIR) {
+			e.dir = scan_dir_new(dir, name, path);
+			dir->refs++;
+		} else {
+			e.path = path;
+			found++;
+		}
+		g_array_append_val(entries, e);
+	}
+
+	if (names)
+		g_ptr_array_free(names, TRUE);
+
+	g_mutex_lock(&scan->mutex);
+	dir->fd = fd;
+	if (dir->refs == 0 && dir->fd != -1) {
+		close(dir->fd);
+		dir->fd = -1;
+	}
+	dir->entries = entries;
+	dir->read = true;
+	scan->found += found;
+	if (parent && --parent->refs == 0 && parent->fd != -1) {
+		close(parent->fd);
+		parent->fd = -1;
+	}
+
+	// still locked: scan_next() frees dir once all of these are read
+	for (guint i = 0; !scan->stopped && i < entries->len; i++) {
+		struct scan_entry *e = &g_array_index(entries, struct scan_entry, i);
+		if (e->dir)
+			g_thread_pool_push(scan->pool, e->dir, NULL);
+	}
+	g_cond_broadcast(&scan->read);
+	g_mutex_unlock(&scan->mutex);
+}
+
+/*
+ * starts scanning root for videos without subtitles, which are then
+ * returned by scan_next() as soon as they are found.
+ */
+static struct scan *scan_start(const char *root) {
+	struct scan *scan = g_new0(struct scan, 1);
+	g_mutex_init(&scan->mutex);
+	g_cond_init(&scan->read);
+	scan->pool = g_thread_pool_new(scan_dir_run, scan, SCAN_THREADS, FALSE, NULL);
+	scan->stack = g_ptr_array_new();
+	scan->root = g_strdup(root);
+
+	struct scan_dir *dir = scan_dir_new(NULL, NULL, strdup(root));
+	if (!dir->path) {
+		log_oom();
+		scan_dir_free(dir);
+		return scan;
+	}
+	g_ptr_array_add(scan->stack, dir);
+	g_thread_pool_push(scan->pool, dir, NULL);
+	return scan;
+}
+
+/*
+ * returns the next video of the scan (to be freed), or NULL once all
+ * have been returned. The order is the same as for a sequential walk,
+ * with the entries of each directory sorted by name.
+ */
+static char *scan_next(struct scan *scan) {
+	char *path = NULL;
+
+	g_mutex_lock(&scan->mutex);
+	while (!path && scan->stack->len > 0) {
+		struct scan_dir *dir = g_ptr_array_index(scan->stack, scan->stack->len - 1);
+		while (!dir->read)
+			g_cond_wait(&scan->read, &scan->mutex);
+
+		if (dir->next == dir->entries->len) {
+			// all subdirectories have been read, so no scan thread uses dir anymore
+			g_ptr_array_remove_index(scan->stack, scan->stack->len - 1);
+			scan_dir_free(dir);
+			continue;
+		}
+
+		struct scan_entry *e = &g_array_index(dir->entries, struct scan_entry, dir->next++);
+		if (e->dir)
+			g_ptr_array_add(scan->stack, e->dir);
+		path = e->path;
+		e->path = NULL;
+		e->dir = NULL;
+	}
+	g_mutex_unlock(&scan->mutex);
+
+	return path;
+}
+
+/*
+ * stops the scan, the directories which are still queued aren't read.
+ */
+static void scan_free(struct scan *scan) {
+	g_mutex_lock(&scan->mutex);
+	scan->stopped = true;
+	g_mutex_unlock(&scan->mutex);
+
+	g_thread_pool_free(scan->pool, TRUE, TRUE);
+	for (guint i = 0; i < scan->stack->len; i++)
+		scan_dir_free(g_ptr_array_index(scan->stack, i));
+	g_ptr_array_free(scan->stack, TRUE);
+	g_cond_clear(&scan->read);
+	g_mutex_clear(&scan->mutex);
+	g_free(scan->root);
+	g_free(scan);
+}
+
+/*
+ * returns the next file to process (to be freed), or NULL at the end:
+ * first the files from the command line, then those from --files-from.
+ * With --recursive, directories are replaced by the videos found in them.
+ */
+static char *next_file(struct file_source *src) {
+	for (;;) {
+		char *path = NULL;
+
+		if (src->found && src->found_next < src->found->len)
+			return g_ptr_array_index(src->found, src->found_next++);
+
+		if (src->scan) {
+			path = scan_next(src->scan);
+			if (path)
+				return path;
+			log_info("found %u videos without subtitles in %s.", src->scan->found, src->scan->root);
+			scan_free(src->scan);
+			src->scan = NULL;
+		}
+
+		if (src->n_args > 0) {
+			path = strdup(*src->args);
+			src->args++;
+			src->n_args--;
+			if (!path) {
+				log_oom();
+				return NULL;
+			}
+		} else if (src->list) {
+			size_t len = 0;
+			ssize_t n = getdelim(&path, &len, src->delim, src->list);
+			if (n == -1) {
+				free(path);
+				return NULL;
+			}
+			if (path[n - 1] == src->delim)
+				path[n - 1] = '\0';
+			if (path[0] == '\0') {
+				free(path);
+				continue;
+			}
+		} else {
+			return NULL;
+		}
+
+		struct stat st;
+		if (!recursive || stat(path, &st) == -1 || !S_ISDIR(st.st_mode))
+			return path;
+
+		// the videos are returned while the scan threads are still looking for more
+		log_info("scanning %s...", path);
+		src->scan = scan_start(path);
+		free(path);
+	}
+}
+
+/*
+ * runs in one of the hashing threads, therefore this must neither log
+ * nor touch the xmlrpc state.
+ */
+static void hash_job(gpointer data, gpointer user_data) {
+	(void)user_data;
+
+	struct file_job *job = data;
+	int r = 0;
+	gint64 trace_start = trace_now();
+
+	// get hash/filesize, from the cache if the file hasn't changed
+	if (!name_search_only) {
+		struct stat st;
+		bool cached = hash_cache != HASH_CACHE_NONE && stat(job->filepath, &st) == 0 &&
+		              hash_cache_lookup(job->filepath, &st, &job->hash);
+
+		if (cached) {
+			job->filesize = st.st_size;
+		} else {
+			_cleanup_close_ int fd = open(job->filepath, O_RDONLY | O_CLOEXEC);
+			if (fd != -1)
+				r = get_hash_and_filesize(fd, &job->hash, &job->filesize);
+			else
+				r = errno;
+
+			if (r == 0 && hash_cache != HASH_CACHE_NONE && fstat(fd, &st) == 0)
+				hash_cache_store(job->filepath, &st, job->hash);
+		}
+
+		// the head and the tail are read, unless the hash was cached
+		size_t bytes = cached || r != 0 ? 0 : job->filesize < HASH_CHUNK ? job->filesize : 2 * HASH_CHUNK;
+		trace_job(job, PHASE_HASH, trace_start, trace_now(), bytes);
+	}
+
+	g_mutex_lock(&hash_mutex);
+	job->r = r;
+	job->hashed = true;
+	g_cond_broadcast(&hash_cond);
+	g_mutex_unlock(&hash_mutex);
+}
+
+/*
+ * creates jobs for up to n files from src and queues them for hashing.
+ * The number of jobs is returned in n_jobs, which is 0 at the end of src.
+ */
+static struct file_job *hash_start(struct file_source *src, int n, int *n_jobs) {
+	struct file_job *jobs = calloc(n, sizeof(struct file_job));
+	if (!jobs)
+		return NULL;
+
+	*n_jobs = 0;
+	for (int i = 0; i < n; i++) {
+		char *filepath = next_file(src);
+		if (!filepath)
+			break;
+
+		jobs[i].filepath = filepath;
 
-		if (i != n - 1)
-			print_separator(c, digit_count);
+		jobs[i].filename = strrchr(filepath, '/');
+		if (jobs[i].filename)
+			jobs[i].filename++; // skip '/'
+		else
+			jobs[i].filename = filepath;
+
+		g_thread_pool_push(hash_pool, &jobs[i], NULL);
+		(*n_jobs)++;
 	}
-	putchar('\n');
+
+	return jobs;
 }
 
-static int choose_from_results(xmlrpc_value *results, int n, int *sub_id, const char **sub_filename) {
-	int r = 0;
-	struct sub_info sub_infos[n];
+static void hash_wait(struct file_job *job) {
+	g_mutex_lock(&hash_mutex);
+	while (!job->hashed)
+		g_cond_wait(&hash_cond, &hash_mutex);
+	g_mutex_unlock(&hash_mutex);
+}
 
-	int sel = 0; // selected list item
+/*
+ * frees jobs created by hash_start(), after the hashing threads are done with them.
+ */
+static void free_jobs(struct file_job *jobs, int n) {
+	if (!jobs)
+		return;
 
-	/* Make the values in the "Release / File Name" column
-	 * at least as long as the header title itself. */
-	int align_release_name = strlen(HEADER_RELEASE_NAME);
+	for (int i = 0; i < n; i++) {
+		hash_wait(&jobs[i]);
+		free((void *)jobs[i].filepath);
+	}
+	free(jobs);
+}
+
+/*
+ * prepares the download of a search result of a job.
+ */
+static int select_sub(struct file_job *job, struct selection *selection,
+                      const struct sub_info *sub_info, const char *sub_lang) {
+	selection->sub_id = sub_info->id;
+	selection->sub_size = sub_info->size;
+	selection->lang = sub_info->lang;
+	selection->sub_filename = sub_info->filename;
+	selection->matched_by_hash = sub_info->matched_by_hash;
+
+	selection->sub_filepath = get_sub_path(job->filepath, sub_info->filename, sub_lang);
+	if (!selection->sub_filepath)
+		return log_oom();
+
+	return check_sub_path(selection->sub_filepath);
+}
+
+/*
+ * --per-language: selects one result of every language without asking:
+ * the first hash match, otherwise the most similar name-based result
+ * (--auto-select) or the first one (-n). Other languages are skipped.
+ */
+static int choose_per_language(struct file_job *job) {
+	int n = job->n_sub_infos;
+
+	job->selections = calloc(n, sizeof(struct selection));
+	_cleanup_free_ struct sub_info *group = calloc(n, sizeof(struct sub_info));
+	_cleanup_free_ int *group_index = calloc(n, sizeof(int));
+	if (!job->selections || !group || !group_index)
+		return log_oom();
 
 	for (int i = 0; i < n; i++) {
-		_cleanup_xmlrpc_ xmlrpc_value *oneresult = NULL;
-		xmlrpc_array_read_item(&env, results, i, &oneresult);
+		const char *sub_lang = job->sub_infos[i].lang;
+
+		// the languages in the order of their first result
+		bool seen = false;
+		for (int j = 0; j < i && !seen; j++)
+			seen = strcmp(job->sub_infos[j].lang, sub_lang) == 0;
+		if (seen)
+			continue;
+
+		int n_group = 0;
+		for (int j = i; j < n; j++) {
+			if (strcmp(job->sub_infos[j].lang, sub_lang) == 0) {
+				group[n_group] = job->sub_infos[j];
+				group_index[n_group++] = j;
+			}
+		}
 
-		// dear OpenSubtitles.org, why are these IDs provided as strings?
-		_cleanup_free_ const char *sub_id_str = struct_get_string(oneresult, "IDSubtitleFile");
-		_cleanup_free_ const char *matched_by_str = struct_get_string(oneresult, "MatchedBy");
+		int sel = 0;
+		for (int j = 0; j < n_group && sel == 0; j++) {
+			if (group[j].matched_by_hash)
+				sel = j + 1;
+		}
 
-		sub_infos[i].id = strtol(sub_id_str, NULL, 10);
-		sub_infos[i].matched_by_hash = strcmp(matched_by_str, "moviehash") == 0;
-		sub_infos[i].lang = struct_get_string(oneresult, "SubLanguageID");
-		sub_infos[i].release_name = struct_get_string(oneresult, "MovieReleaseName");
-		sub_infos[i].filename = struct_get_string(oneresult, "SubFileName");
+		if (sel == 0 && auto_select > 0) {
+			sel = rank_results(job->filename, group, n_group);
+			for (int j = 0; j < n_group; j++)
+				job->sub_infos[group_index[j]].score = group[j].score;
+		}
 
-		// select first hash match if one exists
-		if (sub_infos[i].matched_by_hash && sel == 0)
-			sel = i + 1;
+		if (sel == 0 && never_ask)
+			sel = 1;
 
-		int s = strlen(sub_infos[i].release_name);
-		if (s > align_release_name)
-			align_release_name = s;
+		if (sel == 0) {
+			log_err("warning: no %s subtitle for %s can be selected without asking, skipping.", sub_lang, job->filename);
+			continue;
+		}
 
-		s = strlen(sub_infos[i].filename);
-		if (s > align_release_name)
-			align_release_name = s;
+		const struct sub_info *sub_info = &job->sub_infos[group_index[sel - 1]];
+		log_info("%s: %s", sub_lang, sub_info->filename);
+
+		int r = select_sub(job, &job->selections[job->n_selections++], sub_info, sub_lang);
+		if (r != 0)
+			return r;
 	}
 
-	if (never_ask && sel == 0)
-		sel = 1;
+	// the languages of -l without any results
+	gchar **langs = strcmp(lang, "all") != 0 ? g_strsplit(lang, ",", -1) : NULL;
+	for (gchar **l = langs; l && *l; l++) {
+		bool found = false;
+		for (int i = 0; i < n && !found; i++)
+			found = g_ascii_strcasecmp(job->sub_infos[i].lang, *l) == 0;
+		if (!found)
+			log_err("warning: no %s subtitles found for %s.", *l, job->filename);
+	}
+	g_strfreev(langs);
 
-	if (sel == 0 || always_ask) {
-		print_table(sub_infos, n, align_release_name);
+	if (job->n_selections == 0) {
+		log_err("no subtitle for %s can be selected without asking.", job->filename);
+		job->status = "needs-choice";
+		return json ? 0 : 1;
+	}
 
-		_cleanup_free_ char *line = NULL;
-		size_t len = 0;
-		char *endptr = NULL;
-		do {
-			printf("Choose subtitle [1..%i]: ", n);
-			if (getline(&line, &len, stdin) == -1) {
-				r = EIO;
-				goto finish;
-			}
+	return 0;
+}
 
-			sel = strtol(line, &endptr, 10);
-		} while (*endptr != '\n' || sel < 1 || sel > n);
+static int choose_job(struct file_job *job) {
+	int r = 0;
+
+	if (job->n_sub_infos == 0) {
+		log_err("no results for %s.", job->filename);
+		job->status = "no-results";
+		return 1;
 	}
-	else if (!quiet) {
-		print_table(sub_infos, n, align_release_name);
+
+	if (per_language)
+		return choose_per_language(job);
+
+	// let user choose the subtitle to download
+	int sel = 0;
+	r = choose_from_results(job->filename, job->sub_infos, job->n_sub_infos, &sel);
+	if (r != 0)
+		return r;
+
+	// --json: not downloaded, but not failed either
+	if (sel == -1) {
+		job->status = "needs-choice";
+		return 0;
+	}
+
+	job->selections = calloc(1, sizeof(struct selection));
+	if (!job->selections)
+		return log_oom();
+	job->n_selections = 1;
+
+	return select_sub(job, &job->selections[0], &job->sub_infos[sel], NULL);
+}
+
+/*
+ * --json: prints one line describing a processed file.
+ */
+static void json_write_job(const struct file_job *job) {
+	const char *status = job->status;
+	if (!status)
+		status = job->r != 0 ? "error" : "ok";
+
+	fputs("{\"file\":", stdout);
+	json_write_string(stdout, job->filepath);
+	printf(",\"status\":\"%s\"", status);
+	if (job->r != 0)
+		printf(",\"error\":%d", job->r);
+	if (job->hashed && job->r == 0 && !name_search_only)
+		printf(",\"hash\":\"%016" PRIx64 "\",\"size\":%" PRIu64, job->hash, job->filesize);
+	if (job->provider && n_providers > 1) {
+		fputs(",\"provider\":", stdout);
+		json_write_string(stdout, job->provider->url);
+	}
+
+	fputs(",\"results\":[", stdout);
+	for (int i = 0; i < job->n_sub_infos; i++) {
+		const struct sub_info *sub_info = &job->sub_infos[i];
+		printf("%s{\"id\":%d,\"hash_match\":%s,\"lang\":", i > 0 ? "," : "",
+		       sub_info->id, sub_info->matched_by_hash ? "true" : "false");
+		json_write_string(stdout, sub_info->lang);
+		fputs(",\"release_name\":", stdout);
+		json_write_string(stdout, sub_info->release_name);
+		fputs(",\"filename\":", stdout);
+		json_write_string(stdout, sub_info->filename);
+		printf(",\"size\":%ld", sub_info->size);
+		if (sub_info->score >= 0)
+			printf(",\"score\":%d", sub_info->score);
+		putchar('}');
+	}
+	putchar(']');
+
+	if (job->n_selections > 0 && !job->stored)
+		printf(",\"selected\":%d", job->selections[0].sub_id);
+	if (job->stored)
+		fputs(",\"stored\":true", stdout);
+	if (job->n_selections > 0 && job->selections[0].downloaded) {
+		fputs(",\"output\":", stdout);
+		json_write_string(stdout, job->selections[0].sub_filepath);
 	}
 
-	*sub_id = sub_infos[sel - 1].id;
-	*sub_filename = strdup(sub_infos[sel - 1].filename);
+	// --per-language: every selected subtitle
+	if (per_language) {
+		fputs(",\"downloads\":[", stdout);
+		for (int k = 0; k < job->n_selections; k++) {
+			const struct selection *selection = &job->selections[k];
+			printf("%s{\"lang\":", k > 0 ? "," : "");
+			json_write_string(stdout, selection->lang);
+			if (!job->stored)
+				printf(",\"id\":%d", selection->sub_id);
+			if (selection->downloaded) {
+				fputs(",\"output\":", stdout);
+				json_write_string(stdout, selection->sub_filepath);
+			}
+			putchar('}');
+		}
+		putchar(']');
+	}
 
-	if (!*sub_filename) {
-		r = log_oom();
-		goto finish;
+	fputs(",\"timings\":{", stdout);
+	bool first = true;
+	for (int phase = 0; phase < N_PHASES; phase++) {
+		if (job->timings[phase] == 0)
+			continue;
+		printf("%s\"%s\":%.3f", first ? "" : ",", phase_names[phase], job->timings[phase] / 1000.0);
+		first = false;
 	}
+	puts("}}");
+
+	// stream the results, even if stdout is a pipe
+	fflush(stdout);
+}
+
+/*
+ * --json: prints the jobs which are done or failed, in order, as soon as
+ * those before them have been printed. n_written is the number of jobs
+ * printed before.
+ */
+static void json_write_done(const struct file_job *jobs, int n, int n_active, int *n_written) {
+	for (; *n_written < n && *n_written <= n_active; (*n_written)++) {
+		const struct file_job *job = &jobs[*n_written];
+		if (job->r == 0 && !job->done)
+			break;
+		json_write_job(job);
+	}
+}
+
+/*
+ * returns the number of jobs which are still processed: with exit_on_fail,
+ * every file after the first failed one is skipped.
+ */
+static int active_jobs(struct file_job *jobs, int n) {
+	if (!exit_on_fail)
+		return n;
 
-finish:
-	// __attribute__(cleanup) can't be used in structs, let alone arrays
 	for (int i = 0; i < n; i++) {
-		free((void *)sub_infos[i].lang);
-		free((void *)sub_infos[i].release_name);
-		free((void *)sub_infos[i].filename);
+		if (jobs[i].r != 0)
+			return i;
 	}
+	return n;
+}
 
-	return r;
+/*
+ * the number of jobs of a batch which are still active.
+ */
+static int batch_active_jobs(struct batch *batch, struct file_job *jobs, int n_active) {
+	int n = n_active - (batch->jobs - jobs);
+	if (n < 0)
+		return 0;
+	return n < batch->n ? n : batch->n;
 }
 
-static int sub_download(const char *token, int sub_id, const char *file_path) {
-	_cleanup_xmlrpc_ xmlrpc_value *sub_id_xmlval = NULL;
-	_cleanup_xmlrpc_ xmlrpc_value *query_array = NULL;
-	_cleanup_xmlrpc_ xmlrpc_value *result = NULL;;
+/*
+ * processes a window of n files in batches of batch_size. The searches of all batches
+ * are sent at once (max_jobs of them in flight), then the user chooses the
+ * subtitles in order, then all downloads are sent at once. The subtitles
+ * are written in order.
+ */
+static int process_window(struct file_job *jobs, int n) {
+	int n_batches = (n + batch_size - 1) / batch_size;
+	int n_active = n;
+	int n_json = 0; // --json: the jobs printed so far
 
-	_cleanup_xmlrpc_ xmlrpc_value *data = NULL;       // result -> data
-	_cleanup_xmlrpc_ xmlrpc_value *data_0 = NULL;     // result -> data[0]
-	_cleanup_xmlrpc_ xmlrpc_value *data_0_sub = NULL; // result -> data[0][data]
+	// don't let a fault nobody checked fail this window, too
+	env_fault();
 
-	_cleanup_free_ const char *sub_base64 = NULL;	  // the subtitle, gzipped and base64 encoded
+	_cleanup_free_ struct batch *batches = calloc(n_batches, sizeof(struct batch));
+	if (!batches)
+		return log_oom();
 
-	// zlib stuff, see also http://zlib.net/zlib_how.html
-	int z_ret;
-	z_stream z_strm;
-	unsigned char z_out[ZLIB_CHUNK];
-	unsigned char z_in[ZLIB_CHUNK];
-	z_strm.zalloc = Z_NULL;
-	z_strm.zfree = Z_NULL;
-	z_strm.opaque = Z_NULL;
-	z_strm.avail_in = 0;
-	z_strm.next_in = Z_NULL;
+	for (int b = 0; b < n_batches; b++) {
+		batches[b].jobs = &jobs[b * batch_size];
+		batches[b].n = b == n_batches - 1 ? n - b * batch_size : batch_size;
+	}
 
-	_cleanup_fclose_ FILE *f = NULL;
-	int r = 0;
+	// wait for the hashing threads
+	for (int i = 0; i < n_active; i++) {
+		hash_wait(&jobs[i]);
+		if (jobs[i].r == 0)
+			log_info("searching for %s...", jobs[i].filename);
+		else
+			log_err("failed to read %s: %s", jobs[i].filepath, strerror(jobs[i].r));
+		n_active = active_jobs(jobs, n_active);
+	}
 
-	// check if file already exists
-	if (access(file_path, F_OK) == 0) {
-		if (force_overwrite) {
-			log_info("file already exists, overwriting.");
-		} else {
-			log_err("file already exists, aborting. Use -f to force an overwrite.");
-			return EEXIST;
-		}
+	// nothing to search for subtitles in the store
+	for (int i = 0; i < n_active; i++) {
+		if (jobs[i].r == 0)
+			jobs[i].r = store_lookup(&jobs[i]);
+		jobs[i].done = jobs[i].stored;
+		n_active = active_jobs(jobs, n_active);
 	}
+	if (json)
+		json_write_done(jobs, n, n_active, &n_json);
 
-	// download
-	sub_id_xmlval = xmlrpc_int_new(&env, sub_id);
+	// search, unless the results are cached
+	for (int i = 0; i < n_active; i++) {
+		if (jobs[i].r == 0 && !jobs[i].stored)
+			jobs[i].search_cached = search_cache_lookup(&jobs[i]);
+	}
 
-	query_array = xmlrpc_array_new(&env);
-	xmlrpc_array_append_item(&env, query_array, sub_id_xmlval);
+	for (int b = 0; b < n_batches; b++) {
+		int n_batch = batch_active_jobs(&batches[b], jobs, n_active);
+		if (n_batch == 0)
+			break;
 
-	xmlrpc_client_call2f(&env, client, STH_XMLRPC_URL, "DownloadSubtitles", &result, "(sA)", token, query_array);
-	if (env.fault_occurred) {
-		log_err("query failed: %s (%d)", env.fault_string, env.fault_code);
-		return env.fault_code;
+		int r = batch_search_start(&batches[b], n_batch);
+		if (r != 0)
+			fail_batch(&batches[b], n_batch, r);
 	}
 
-	// get base64 encoded data
-	xmlrpc_struct_find_value(&env, result, "data", &data);
-	xmlrpc_array_read_item(&env, data, 0, &data_0);
-	xmlrpc_struct_find_value(&env, data_0, "data", &data_0_sub);
-	xmlrpc_read_string(&env, data_0_sub, &sub_base64);
+	// the results are taken as the searches are answered, see search_decide()
+	rpc_finish_all();
 
-	// decode and decompress to file
-	f = fopen(file_path, "w+");
-	if (!f) {
-		perror("failed to open output file");
-		return errno;
+	for (int b = 0; b < n_batches; b++) {
+		int n_batch = batch_active_jobs(&batches[b], jobs, n_active);
+		if (n_batch == 0)
+			break;
+
+		for (int i = 0; i < n_batch; i++) {
+			if (batches[b].jobs[i].r == 0)
+				search_cache_store(&batches[b].jobs[i]);
+		}
+		batch_search_clean(&batches[b]);
+		n_active = active_jobs(jobs, n_active);
 	}
+	if (json)
+		json_write_done(jobs, n, n_active, &n_json);
 
-	// 16+MAX_WBITS is needed for gzip support
-	z_ret = inflateInit2(&z_strm, 16 + MAX_WBITS);
-	if (z_ret != Z_OK) {
-		log_err("failed to init zlib (%i)", z_ret);
-		return z_ret;
+	// only keep the fields which are needed
+	for (int i = 0; i < n_active; i++) {
+		if (jobs[i].r == 0 && jobs[i].results)
+			jobs[i].r = read_sub_infos(&jobs[i]);
+
+		if (jobs[i].results) {
+			xmlrpc_DECREF(jobs[i].results);
+			jobs[i].results = NULL;
+		}
+		n_active = active_jobs(jobs, n_active);
 	}
 
-	int b64_state = 0;
-	unsigned int b64_save = 0;
-	unsigned int b64_offset = 0;
-	do {
-		// write decoded data to z_in
-		z_strm.avail_in = g_base64_decode_step(&sub_base64[b64_offset], ZLIB_CHUNK, z_in, &b64_state, &b64_save);
-		b64_offset += z_strm.avail_in * 4 / 3; //  base64 encodes 3 bytes in 4 chars
-		if (z_strm.avail_in == 0)
+	// let the user choose
+	for (int i = 0; i < n_active; i++) {
+		if (jobs[i].r == 0 && !jobs[i].stored)
+			jobs[i].r = choose_job(&jobs[i]);
+		if (jobs[i].n_selections == 0)
+			jobs[i].done = true; // e.g. --json and 'needs-choice'
+		n_active = active_jobs(jobs, n_active);
+	}
+	if (json)
+		json_write_done(jobs, n, n_active, &n_json);
+
+	// download
+	for (int b = 0; b < n_batches; b++) {
+		int n_batch = batch_active_jobs(&batches[b], jobs, n_active);
+		if (n_batch == 0)
 			break;
 
-		z_strm.next_in = z_in;
+		batch_download_start(&batches[b], n_batch);
+	}
+	rpc_finish_all();
 
-		// decompress decoded data from z_in to z_out
-		do {
-			z_strm.avail_out = ZLIB_CHUNK;
-			z_strm.next_out = z_out;
-			z_ret = inflate(&z_strm, Z_NO_FLUSH);
+	for (int b = 0; b < n_batches; b++) {
+		int n_batch = batch_active_jobs(&batches[b], jobs, n_active);
+		if (n_batch == 0)
+			break;
 
-			switch (z_ret) {
-			case Z_NEED_DICT:
-				z_ret = Z_DATA_ERROR;
-				// fallthrough
-			case Z_DATA_ERROR:
-			case Z_MEM_ERROR:
-				r = z_ret;
-				log_err("zlib error: %s (%d)", z_strm.msg, z_ret);
-				goto finish;
-			}
-			// write decompressed data from z_out to file
-			unsigned int have = ZLIB_CHUNK - z_strm.avail_out;
+		sub_download_finish(&batches[b], n_batch);
+		for (int i = 0; i < n_batch; i++)
+			batches[b].jobs[i].done = true;
+		n_active = active_jobs(jobs, n_active);
+		if (json)
+			json_write_done(jobs, n, n_active, &n_json);
+	}
 
-			size_t written = fwrite(z_out, 1, have, f);
-			if (written != have) {
-				log_err("failed to write file: %m");
-				r = errno;
-				goto finish;
-			}
-		} while (z_strm.avail_out == 0);
-	} while (z_ret != Z_STREAM_END);
+	// the rest, should any job not have been marked done
+	for (; json && n_json < n && n_json <= n_active; n_json++)
+		json_write_job(&jobs[n_json]);
 
-finish:
-	inflateEnd(&z_strm);
+	// the result is the one of the first failed file
+	int r = 0;
+	for (int i = 0; i < n; i++) {
+		if (r == 0 && i <= n_active)
+			r = jobs[i].r;
+		if (jobs[i].results)
+			xmlrpc_DECREF(jobs[i].results);
+		free_sub_infos(&jobs[i]);
+		for (int k = 0; k < jobs[i].n_selections; k++)
+			free((void *)jobs[i].selections[k].sub_filepath);
+		free(jobs[i].selections);
+	}
+
+	for (int b = 0; b < n_batches; b++) {
+		batch_search_clean(&batches[b]);
+		for (int i = 0; i < batches[b].n_download_rpcs; i++)
+			rpc_clean(&batches[b].download_rpcs[i]);
+		free(batches[b].download_rpcs);
+	}
 
 	return r;
 }
 
-static void show_usage() {
-	puts("Usage: subberthehut [options] <file>...\n\n"
+/*
+ * processes the files from src in windows of max_jobs batches. The files
+ * of the next window are read and hashed while the current one is searched
+ * and downloaded, so only two windows are in memory at any time.
+ * The paths of the files which failed are added to failed, unless it's NULL.
+ */
+static int process_files(struct file_source *src, GPtrArray *failed) {
+	int window = batch_size * max_jobs;
+	int n_window = 0;
+	int r = 0;
 
-	     "OpenSubtitles.org downloader.\n\n"
+	struct file_job *jobs = hash_start(src, window, &n_window);
+	if (!jobs)
+		return log_oom();
 
-	     "subberthehut can do a hash-based and a name-based search.\n"
-	     "On a hash-based search, subberthehut will generate a hash from the specified\n"
-	     "video file and use this to search for appropriate subtitles.\n"
-	     "Any results from this hash-based search should be compatible\n"
-	     "with the video file. Therefore subberthehut will, by default, automatically\n"
-	     "download the first subtitle from these search results.\n"
-	     "In case the hash-based search returns no results, subberthehut will also\n"
-	     "do a name-based search, meaning the OpenSubtitles.org database\n"
-	     "will be searched with the filename of the specified file. The results\n"
-	     "from this search are not guaranteed to be compatible with the video\n"
-	     "file. Therefore subberthehut will, by default, ask the user which subtitle to\n"
-	     "download.\n"
-	     "Results from the hash-based search are marked with an asterisk (*)\n"
-	     "in the 'H' column.\n\n"
+	while (n_window > 0) {
+		int n_next = 0;
+		struct file_job *next_jobs = hash_start(src, window, &n_next);
+		if (!next_jobs) {
+			r = log_oom();
+			break;
+		}
 
-	     "Options:\n"
-	     " -h, --help              Show this help and exit.\n"
-	     "\n"
-	     " -v, --version           Show version information and exit.\n"
-	     "\n"
-	     " -l, --lang <languages>  Comma-separated list of languages to search for,\n"
-	     "                         e.g. 'eng,ger'. Use 'all' to search for all\n"
-	     "                         languages. Default is 'eng'. Use --list-languages\n"
-	     "                         to list all available languages.\n"
-	     "\n"
-	     " -L, --list-languages    List all available languages and exit.\n"
-	     "\n"
-	     " -a, --always-ask        Always ask which subtitle to download, even\n"
-	     "                         when there are hash-based results.\n"
-	     "\n"
-	     " -n, --never-ask         Never ask which subtitle to download, even\n"
-	     "                         when there are only name-based results.\n"
-	     "                         When this option is specified, the first\n"
-	     "                         search result will be downloaded.\n"
-	     "\n"
-	     " -f, --force             Overwrite output file if it already exists.\n"
-	     "\n"
-	     " -o, --hash-search-only  Only do a hash-based search.\n"
-	     "\n"
-	     " -O, --name-search-only  Only do a name-based search. This is useful in\n"
-	     "                         case of false positives from the hash-based search.\n"
-	     "\n"
-	     " -s, --same-name         Download the subtitle to the same filename as the\n"
-	     "                         original file, only replacing the file extension.\n"
-	     "\n"
-	     " -t, --limit <number>    Limits the number of returned results. The default is 10.\n"
-	     "\n"
-	     " -e, --no-exit-on-fail   By default, subberthehut will exit immediately if\n"
-	     "                         multiple files are passed and it fails to download\n"
-	     "                         a subtitle for one them. When this option is passed,\n"
-	     "                         subberthehut will process the next file(s) regardless.\n"
-	     "\n"
-	     " -q, --quiet             Don't print the table if the user doesn't have to be\n"
-	     "                         asked which subtitle to download. Pass this option twice\n"
-	     "                         to suppress anything but warnings and error messages.\n");
+		int window_r = process_window(jobs, n_window);
+		if (window_r != 0)
+			r = window_r;
+
+		for (int i = 0; failed && i < n_window; i++) {
+			if (jobs[i].r != 0)
+				g_ptr_array_add(failed, strdup(jobs[i].filepath));
+		}
+
+		free_jobs(jobs, n_window);
+		jobs = next_jobs;
+		n_window = n_next;
+
+		if (r != 0 && exit_on_fail)
+			break;
+	}
+
+	free_jobs(jobs, n_window);
+
+	return r;
 }
 
-static void show_version() {
-	puts("subberthehut " VERSION "\n"
-	     "https://github.com/mus65/subberthehut/");
+/*
+ * --watch: the directories passed on the command line (and with --recursive
+ * their subdirectories) are watched with inotify. Videos which are written or
+ * moved there are queued and processed once they haven't been touched for
+ * WATCH_DEBOUNCE, using the same client and session for all of them.
+ */
+struct watch {
+	int fd;              // the inotify instance
+	GHashTable *dirs;    // watch descriptor -> directory path
+	GHashTable *pending; // video path -> monotonic time of its last event
+};
+
+static volatile sig_atomic_t watch_stopped = 0;
+
+static void watch_stop(int sig) {
+	(void)sig;
+	watch_stopped = 1;
 }
 
-static const char *get_sub_path(const char *filepath, const char *sub_filename) {
-	char *sub_filepath;
+/*
+ * watches path and, with --recursive, all directories below it.
+ */
+static void watch_add(struct watch *w, const char *path) {
+	// IN_MODIFY only restarts the debounce of videos which are still being written
+	uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MODIFY | IN_ONLYDIR;
+	if (recursive)
+		mask |= IN_CREATE;
+
+	int wd = inotify_add_watch(w->fd, path, mask);
+	if (wd == -1) {
+		log_err("warning: failed to watch %s: %m", path);
+		return;
+	}
+	g_hash_table_replace(w->dirs, GINT_TO_POINTER(wd), g_strdup(path));
 
-	if (same_name) {
-		const char *sub_ext = strrchr(sub_filename, '.');
-		if (!sub_ext) {
-			log_err("warning: subtitle filename from the OpenSubtitles.org "
-			        "database has no file extension, assuming .srt.");
-			sub_ext = ".srt";
-		}
-		const char *lastdot = strrchr(filepath, '.');
-		int index;
-		if (!lastdot)
-			index = strlen(filepath) - 1;
-		else
-			index = (lastdot - filepath);
+	if (!recursive)
+		return;
 
-		sub_filepath = malloc(index + 1 + strlen(sub_ext) + 1);
-		if (!sub_filepath)
-			return NULL;
+	_cleanup_close_ int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	GPtrArray *entries = fd != -1 ? read_dir_entries(fd, path) : NULL;
 
-		strncpy(sub_filepath, filepath, index);
-		sub_filepath[index] = '\0';
-		strcat(sub_filepath, sub_ext);
-	} else {
-		const char *lastslash = strrchr(filepath, '/');
-		if (!lastslash) {
-			sub_filepath = strdup(sub_filename);
-			if (!sub_filepath)
-				return NULL;
-		} else {
-			int index = (lastslash - filepath);
-			sub_filepath = malloc(index + 1 + strlen(sub_filename) + 1);
-			if (!sub_filepath)
-				return NULL;
+	for (guint i = 0; entries && i < entries->len; i++) {
+		const char *entry = g_ptr_array_index(entries, i);
+		struct stat st;
 
-			strncpy(sub_filepath, filepath, index + 1);
-			sub_filepath[index + 1] = '\0';
-			strcat(sub_filepath, sub_filename);
+		// don't follow symlinks to directories, like the library scan
+		if (entry[0] != DT_DIR && (entry[0] != DT_UNKNOWN ||
+		    fstatat(fd, entry + 1, &st, AT_SYMLINK_NOFOLLOW) == -1 || !S_ISDIR(st.st_mode)))
+			continue;
+
+		_cleanup_free_ char *entry_path = NULL;
+		if (asprintf(&entry_path, "%s/%s", path, entry + 1) == -1) {
+			log_oom();
+			break;
 		}
+		watch_add(w, entry_path);
 	}
-	return sub_filepath;
+
+	if (entries)
+		g_ptr_array_free(entries, TRUE);
 }
 
-static int process_file(const char *filepath, const char *token) {
-	_cleanup_fclose_ FILE *f = NULL;
-	uint64_t hash = 0, filesize = 0;
+/*
+ * (re)starts the debounce time of a video.
+ */
+static void watch_queue(struct watch *w, char *path) {
+	gint64 *time = g_new(gint64, 1);
+	*time = g_get_monotonic_time();
+	g_hash_table_replace(w->pending, path, time);
+}
 
-	_cleanup_xmlrpc_ xmlrpc_value *results = NULL;
+static void watch_read_events(struct watch *w) {
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t len;
 
-	_cleanup_free_ const char *sub_filename = NULL;
-	_cleanup_free_ const char *sub_filepath = NULL;
+	while ((len = read(w->fd, buf, sizeof(buf))) > 0) {
+		const struct inotify_event *event;
+		for (char *p = buf; p < buf + len; p += sizeof(struct inotify_event) + event->len) {
+			event = (const struct inotify_event *)p;
 
-	int r = 0;
+			if (event->mask & IN_Q_OVERFLOW) {
+				log_err("warning: too many events, some files might have been missed.");
+				continue;
+			}
 
-	// get hash/filesize
-	if (!name_search_only) {
-		f = fopen(filepath, "r");
-		if (!f) {
-			log_err("failed to open %s: %m", filepath);
-			return errno;
+			if (event->mask & IN_IGNORED) {
+				g_hash_table_remove(w->dirs, GINT_TO_POINTER(event->wd));
+				continue;
+			}
+
+			const char *dir = g_hash_table_lookup(w->dirs, GINT_TO_POINTER(event->wd));
+			if (!dir || event->len == 0)
+				continue;
+
+			char *path = g_strdup_printf("%s/%s", dir, event->name);
+
+			if (event->mask & IN_ISDIR) {
+				// a new subdirectory, maybe already with videos in it. It's watched
+				// before it's scanned, so no video added in between is missed.
+				if (recursive) {
+					watch_add(w, path);
+					struct scan *scan = scan_start(path);
+					for (char *video; (video = scan_next(scan));)
+						watch_queue(w, video);
+					scan_free(scan);
+				}
+				g_free(path);
+			} else if ((event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) && is_video(event->name)) {
+				watch_queue(w, path);
+			} else if ((event->mask & IN_MODIFY) && g_hash_table_contains(w->pending, path)) {
+				// e.g. a video found in a new directory which is still being copied
+				watch_queue(w, path);
+			} else {
+				g_free(path);
+			}
+		}
+	}
+}
+
+/*
+ * returns the videos which haven't been touched for WATCH_DEBOUNCE (sorted),
+ * or NULL if there are none. The time until the next one is due is
+ * returned in timeout (ms), -1 if nothing is pending.
+ */
+static GPtrArray *watch_due(struct watch *w, int *timeout) {
+	GPtrArray *due = NULL;
+	GHashTableIter iter;
+	gpointer path, time;
+	gint64 now = g_get_monotonic_time();
+
+	*timeout = -1;
+
+	g_hash_table_iter_init(&iter, w->pending);
+	while (g_hash_table_iter_next(&iter, &path, &time)) {
+		gint64 left = *(gint64 *)time + WATCH_DEBOUNCE - now;
+		if (left > 0) {
+			int ms = (left + 999) / 1000;
+			if (*timeout == -1 || ms < *timeout)
+				*timeout = ms;
+			continue;
 		}
 
-		get_hash_and_filesize(f, &hash, &filesize);
+		// the subtitle might have been added together with the video
+		if (force_overwrite || !has_subtitle(AT_FDCWD, path)) {
+			if (!due)
+				due = g_ptr_array_new();
+			g_ptr_array_add(due, strdup(path));
+		}
+		g_hash_table_iter_remove(&iter);
 	}
 
-	const char *filename = strrchr(filepath, '/');
-	if (filename)
-		filename++; // skip '/'
-	else
-		filename = filepath;
+	if (due)
+		qsort(due->pdata, due->len, sizeof(char *), compare_strings);
 
-	log_info("searching for %s...", filename);
+	return due;
+}
 
-	r = search_get_results(token, hash, filesize, filename, &results);
-	if (r != 0)
-		return r;
+/*
+ * the server forgets idle sessions, so use it once in a while.
+ */
+static void keep_alive(struct provider *provider) {
+	_cleanup_rpc_ struct rpc rpc = { .provider = provider, .method = "NoOperation", .with_token = true };
 
-	int results_length = xmlrpc_array_size(&env, results);
-	if (env.fault_occurred) {
-		log_err("failed to get array size: %s (%d)", env.fault_string, env.fault_code);
-		return env.fault_code;
+	// there is no session before the first search
+	if (!provider->token)
+		return;
+
+	rpc.params = xmlrpc_array_new(&env);
+	rpc_call(&rpc);
+	if (rpc_check(&rpc) == 0)
+		token_cache_touch(provider);
+}
+
+static int watch_dirs(char **dirs, int n_dirs) {
+	struct watch w = {0};
+	int r = 0;
+
+	w.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (w.fd == -1) {
+		log_err("failed to init inotify: %m");
+		return errno;
 	}
+	w.dirs = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+	w.pending = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
 
-	if (results_length == 0) {
-		log_err("no results.");
-		return 1;
+	for (int i = 0; i < n_dirs; i++)
+		watch_add(&w, dirs[i]);
+
+	if (g_hash_table_size(w.dirs) == 0) {
+		log_err("no directories to watch.");
+		r = 1;
+		goto finish;
 	}
 
-	// let user choose the subtitle to download
-	int sub_id = 0;
-	r = choose_from_results(results, results_length, &sub_id, &sub_filename);
-	if (r != 0)
-		return r;
+	// stop between files on SIGINT/SIGTERM, so the caches are written
+	struct sigaction sa = { .sa_handler = watch_stop };
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
 
-	sub_filepath = get_sub_path(filepath, sub_filename);
-	if (!sub_filepath)
-		return log_oom();
+	log_info("watching %u directories for new videos...", g_hash_table_size(w.dirs));
 
-	log_info("downloading to %s ...", sub_filepath);
-	r = sub_download(token, sub_id, sub_filepath);
+	// a video which fails doesn't stop the others, see process_files()
+	exit_on_fail = false;
+
+	time_t last_used = time(NULL);
+	while (!watch_stopped) {
+		int timeout = -1;
+		GPtrArray *due = watch_due(&w, &timeout);
+
+		if (due) {
+			struct file_source src = { .found = due };
+			GPtrArray *failed = g_ptr_array_new_with_free_func(free);
+
+			if (process_files(&src, failed) != 0 && failed->len == 0)
+				log_err("warning: failed to process the new videos.");
+			for (guint i = 0; i < failed->len; i++) {
+				if (g_ptr_array_index(failed, i))
+					log_err("warning: %s failed, it's processed again once it changes.", (char *)g_ptr_array_index(failed, i));
+			}
+			g_ptr_array_free(failed, TRUE);
+
+			// the videos have been passed on to the jobs
+			for (guint i = src.found_next; i < due->len; i++)
+				free(g_ptr_array_index(due, i));
+			g_ptr_array_free(due, TRUE);
+
+			for (int p = 0; p < n_providers; p++)
+				token_cache_touch(&providers[p]);
+			last_used = time(NULL);
+			continue;
+		}
+
+		long idle = time(NULL) - last_used;
+		if (idle >= WATCH_KEEPALIVE) {
+			for (int p = 0; p < n_providers; p++)
+				keep_alive(&providers[p]);
+			last_used = time(NULL);
+			continue;
+		}
+
+		int keepalive = (WATCH_KEEPALIVE - idle) * 1000;
+		if (timeout == -1 || keepalive < timeout)
+			timeout = keepalive;
+
+		struct pollfd pfd = { .fd = w.fd, .events = POLLIN };
+		if (poll(&pfd, 1, timeout) == -1) {
+			if (errno == EINTR)
+				continue;
+			log_err("failed to wait for events: %m");
+			r = errno;
+			break;
+		}
+
+		if (pfd.revents & POLLIN)
+			watch_read_events(&w);
+	}
+
+finish:
+	g_hash_table_destroy(w.pending);
+	g_hash_table_destroy(w.dirs);
+	close(w.fd);
 
 	return r;
 }
 
-static int list_sub_languages() {
-	_cleanup_xmlrpc_ xmlrpc_value *result = NULL;
+static int list_sub_languages(struct provider *provider) {
+	_cleanup_rpc_ struct rpc rpc = { .provider = provider, .method = "GetSubLanguages" };
 	_cleanup_xmlrpc_ xmlrpc_value *languages = NULL;
 
-	xmlrpc_client_call2f(&env, client, STH_XMLRPC_URL, "GetSubLanguages", &result, "()");
-	if (env.fault_occurred) {
-		log_err("failed to download languages: %s (%d)", env.fault_string, env.fault_code);
-		return env.fault_code;
+	rpc.params = xmlrpc_array_new(&env);
+	if (rpc_call(&rpc) != 0) {
+		log_err("failed to download languages: %s (%d)", rpc.fault_string, rpc.fault_code);
+		return rpc.fault_code;
 	}
 
-	xmlrpc_struct_read_value(&env, result, "data", &languages);
+	xmlrpc_struct_read_value(&env, rpc.result, "data", &languages);
 	if (env.fault_occurred) {
 		log_err("failed to get data: %s (%d)", env.fault_string, env.fault_code);
-		return env.fault_code;
+		return env_fault();
 	}
 
 	int n = xmlrpc_array_size(&env, languages);
 	if (env.fault_occurred) {
 		log_err("failed to get array size: %s (%d)", env.fault_string, env.fault_code);
-		return env.fault_code;
+		return env_fault();
 	}
 
 	for (int i = 0; i < n; i++) {
@@ -705,7 +5079,8 @@ static int list_sub_languages() {
 }
 
 int main(int argc, char *argv[]) {
-	_cleanup_free_ const char *token = NULL;
+	struct file_source src = {0};
+	char *lang_ids = NULL;
 
 	int r = EXIT_SUCCESS;
 
@@ -721,6 +5096,28 @@ int main(int argc, char *argv[]) {
 		{"name-search-only", no_argument, NULL, 'O'},
 		{"same-name", no_argument, NULL, 's'},
 		{"limit", required_argument, NULL, 't'},
+		{"batch", required_argument, NULL, 'b'},
+		{"jobs", required_argument, NULL, 'j'},
+		{"hash-threads", required_argument, NULL, 'H'},
+		{"hash-cache", required_argument, NULL, 'C'},
+		{"search-cache-ttl", required_argument, NULL, OPT_SEARCH_CACHE_TTL},
+		{"search-cache-size", required_argument, NULL, OPT_SEARCH_CACHE_SIZE},
+		{"hash-cache-size", required_argument, NULL, OPT_HASH_CACHE_SIZE},
+		{"recursive", no_argument, NULL, 'r'},
+		{"files-from", required_argument, NULL, 'F'},
+		{"null", no_argument, NULL, '0'},
+		{"watch", no_argument, NULL, 'w'},
+		{"url", required_argument, NULL, OPT_URL},
+		{"trace", required_argument, NULL, OPT_TRACE},
+		{"stats", no_argument, NULL, OPT_STATS},
+		{"rate", required_argument, NULL, OPT_RATE},
+		{"json", no_argument, NULL, OPT_JSON},
+		{"auto-select", required_argument, NULL, OPT_AUTO_SELECT},
+		{"per-language", no_argument, NULL, OPT_PER_LANGUAGE},
+		{"store", required_argument, NULL, OPT_STORE},
+		{"retries", required_argument, NULL, OPT_RETRIES},
+		{"hedge", required_argument, NULL, OPT_HEDGE},
+		{"hedge-budget", required_argument, NULL, OPT_HEDGE_BUDGET},
 		{"no-exit-on-fail", no_argument, NULL, 'e'},
 		{"quiet", no_argument, NULL, 'q'},
 		{"version", no_argument, NULL, 'v'},
@@ -728,7 +5125,7 @@ int main(int argc, char *argv[]) {
 	};
 
 	int c;
-	while ((c = getopt_long(argc, argv, "hl:LanfoOst:eqv", opts, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "hl:LanfoOst:b:j:H:C:rF:0weqv", opts, NULL)) != -1) {
 		switch (c) {
 		case 'h':
 			show_usage();
@@ -780,6 +5177,198 @@ int main(int argc, char *argv[]) {
 			break;
 		}
 
+		case 'b':
+		{
+			char *endptr = NULL;
+			batch_size = strtol(optarg, &endptr, 10);
+
+			if (*endptr != '\0' || batch_size < 1) {
+				log_err("invalid batch size: %s", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		}
+
+		case 'j':
+		{
+			char *endptr = NULL;
+			max_jobs = strtol(optarg, &endptr, 10);
+
+			if (*endptr != '\0' || max_jobs < 1) {
+				log_err("invalid number of jobs: %s", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		}
+
+		case 'H':
+		{
+			char *endptr = NULL;
+			hash_threads = strtol(optarg, &endptr, 10);
+
+			if (*endptr != '\0' || hash_threads < 1) {
+				log_err("invalid number of hashing threads: %s", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		}
+
+		case 'C':
+			if (strcmp(optarg, "file") == 0) {
+				hash_cache = HASH_CACHE_FILE;
+			} else if (strcmp(optarg, "xattr") == 0) {
+				hash_cache = HASH_CACHE_XATTR;
+			} else if (strcmp(optarg, "none") == 0) {
+				hash_cache = HASH_CACHE_NONE;
+			} else {
+				log_err("invalid hash cache: %s", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+
+		case OPT_SEARCH_CACHE_TTL:
+		{
+			char *endptr = NULL;
+			search_cache_ttl = strtol(optarg, &endptr, 10);
+
+			if (*endptr != '\0' || search_cache_ttl < 0) {
+				log_err("invalid search cache TTL: %s", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		}
+
+		case OPT_SEARCH_CACHE_SIZE:
+		{
+			char *endptr = NULL;
+			search_cache_size = strtol(optarg, &endptr, 10);
+
+			if (*endptr != '\0' || search_cache_size < 0) {
+				log_err("invalid search cache size: %s", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		}
+
+		case OPT_HASH_CACHE_SIZE:
+		{
+			char *endptr = NULL;
+			hash_cache_size = strtol(optarg, &endptr, 10);
+
+			if (*endptr != '\0' || hash_cache_size < HASH_CACHE_SLOTS) {
+				log_err("invalid hash cache size: %s", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		}
+
+		case 'r':
+			recursive = true;
+			break;
+
+		case 'F':
+			files_from = optarg;
+			break;
+
+		case '0':
+			null_delimited = true;
+			break;
+
+		case 'w':
+			watch = true;
+			break;
+
+		case OPT_URL:
+			if (n_urls == MAX_PROVIDERS) {
+				log_err("too many servers, at most %d can be used.", MAX_PROVIDERS);
+				return EXIT_FAILURE;
+			}
+			urls[n_urls++] = optarg;
+			break;
+
+		case OPT_TRACE:
+			trace_path = optarg;
+			break;
+
+		case OPT_STATS:
+			stats = true;
+			break;
+
+		case OPT_RATE:
+		{
+			char *endptr = NULL;
+			rate_requests = strtol(optarg, &endptr, 10);
+			rate_window = 1;
+			if (*endptr == '/')
+				rate_window = strtol(endptr + 1, &endptr, 10);
+
+			if (*endptr != '\0' || rate_requests < 0 || rate_window < 1) {
+				log_err("invalid rate: %s", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		}
+
+		case OPT_JSON:
+			json = true;
+			break;
+
+		case OPT_AUTO_SELECT:
+		{
+			char *endptr = NULL;
+			auto_select = strtol(optarg, &endptr, 10);
+
+			if (*endptr != '\0' || auto_select < 1 || auto_select > 100) {
+				log_err("invalid auto-select threshold: %s", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		}
+
+		case OPT_PER_LANGUAGE:
+			per_language = true;
+			break;
+
+		case OPT_STORE:
+			store_dir = optarg;
+			break;
+
+		case OPT_RETRIES:
+		{
+			char *endptr = NULL;
+			max_retries = strtol(optarg, &endptr, 10);
+
+			if (*endptr != '\0' || max_retries < 0 || max_retries > RETRIES_MAX) {
+				log_err("invalid number of retries: %s", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		}
+
+		case OPT_HEDGE:
+		{
+			char *endptr = NULL;
+			hedge_percentile = strtol(optarg, &endptr, 10);
+
+			if (*endptr != '\0' || hedge_percentile < 1 || hedge_percentile > 99) {
+				log_err("invalid hedge percentile: %s", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		}
+
+		case OPT_HEDGE_BUDGET:
+		{
+			char *endptr = NULL;
+			hedge_budget = strtol(optarg, &endptr, 10);
+
+			if (*endptr != '\0' || hedge_budget < 0 || hedge_budget > 100) {
+				log_err("invalid hedge budget: %s", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		}
+
 		case 'e':
 			exit_on_fail = false;
 			break;
@@ -798,45 +5387,143 @@ int main(int argc, char *argv[]) {
 	}
 
 	// check if user has specified at least one file (except for listing languages)
-	if (argc - optind < 1 && !list_languages) {
+	if (argc - optind < 1 && !files_from && !list_languages) {
 		show_usage();
 		return EXIT_FAILURE;
 	}
 
+	if (watch && (files_from || argc - optind < 1)) {
+		log_err("--watch needs the directories to watch and can't be combined with --files-from.");
+		return EXIT_FAILURE;
+	}
+
+	if (strcmp(lang, "all") != 0) {
+		lang_ids = normalize_langs(lang);
+		lang = lang_ids;
+		for (const char *c = lang; *c; c++) {
+			if (*c == ',')
+				n_langs++;
+		}
+	}
+
+	tracing = trace_path || stats;
+	timing = tracing || json;
+	trace_origin = trace_now();
+
 	// xmlrpc init
 	xmlrpc_env_init(&env);
 	xmlrpc_client_setup_global_const(&env);
 	// make sure the library doesn't complain about too much data
 	xmlrpc_limit_set(XMLRPC_XML_SIZE_LIMIT_ID, STH_XMLRPC_SIZE_LIMIT);
 
-	xmlrpc_client_create(&env, XMLRPC_CLIENT_NO_FLAGS, "subberthehut", VERSION, NULL, 0, &client);
+	/* all rpcs are started on this one client, i.e. on the same curl multi
+	 * handle, so its connection cache keeps the connection (and the TLS session)
+	 * to the server alive between them. Without timeouts a stalled connection
+	 * would block the whole run. */
+	struct xmlrpc_curl_xportparms curl_parms = {
+		.timeout = RPC_TIMEOUT,
+		.connect_timeout = RPC_CONNECT_TIMEOUT,
+	};
+	struct xmlrpc_clientparms client_parms = {
+		.transport = "curl",
+		.transportparmsP = &curl_parms,
+		.transportparm_size = XMLRPC_CXPSIZE(connect_timeout),
+	};
+
+	xmlrpc_client_create(&env, XMLRPC_CLIENT_NO_FLAGS, "subberthehut", VERSION,
+	                     &client_parms, XMLRPC_CPSIZE(transportparm_size), &client);
 	if (env.fault_occurred) {
 		log_err("failed to init xmlrpc client: %s (%d)", env.fault_string, env.fault_code);
 		r = env.fault_code;
 		goto finish;
 	}
 
-	// login
-	r = login(&token);
-	if (r != 0)
-		goto finish;
+	if (n_urls == 0)
+		urls[n_urls++] = STH_XMLRPC_URL;
+
+	for (int i = 0; i < n_urls; i++) {
+		struct provider *provider = &providers[n_providers];
+		provider->url = urls[i];
+		provider->server = xmlrpc_server_info_new(&env, urls[i]);
+		if (env.fault_occurred) {
+			log_err("failed to init xmlrpc server info: %s (%d)", env.fault_string, env.fault_code);
+			r = env.fault_code;
+			goto finish;
+		}
+		n_providers++;
+	}
 
 	// only list the languages and exit
 	if (list_languages) {
-		r = list_sub_languages();
+		r = list_sub_languages(&providers[0]);
 		goto finish;
 	}
 
-	// process files
-	for (int i = optind; i < argc; i++) {
-		char *filepath = argv[i];
-		r = process_file(filepath, token);
-		if (r != 0 && exit_on_fail)
+	// files to process, --files-from is read while processing
+	src.args = &argv[optind];
+	src.n_args = argc - optind;
+	src.delim = null_delimited ? '\0' : '\n';
+	if (files_from) {
+		src.list = strcmp(files_from, "-") == 0 ? stdin : fopen(files_from, "re");
+		if (!src.list) {
+			log_err("failed to open %s: %m", files_from);
+			r = errno;
 			goto finish;
+		}
+
+		// stdin is taken, ask the user on the terminal
+		if (src.list == stdin) {
+			prompt_input = fopen("/dev/tty", "re");
+			if (!prompt_input)
+				prompt_input = stdin;
+		}
 	}
 
+	// process files
+	hash_cache_open();
+	search_cache_open();
+	hash_pool = g_thread_pool_new(hash_job, NULL, hash_threads, FALSE, NULL);
+	if (watch)
+		r = watch_dirs(&argv[optind], argc - optind);
+	else
+		r = process_files(&src, NULL);
+
 finish:
+	for (int i = 0; i < n_providers; i++) {
+		if (providers[i].token) {
+			token_cache_touch(&providers[i]);
+			free((void *)providers[i].token);
+		}
+	}
+	if (hash_pool)
+		g_thread_pool_free(hash_pool, FALSE, TRUE);
+	if (trace_path)
+		trace_write();
+	if (stats)
+		stats_print();
+	trace_free();
+	hash_cache_close();
+	if (src.list && src.list != stdin)
+		fclose(src.list);
+	if (prompt_input && prompt_input != stdin)
+		fclose(prompt_input);
+	if (src.scan)
+		scan_free(src.scan);
+	if (src.found) {
+		for (guint i = src.found_next; i < src.found->len; i++)
+			free(g_ptr_array_index(src.found, i));
+		g_ptr_array_free(src.found, TRUE);
+	}
+	free(search_cache_dir);
+	g_free(search_cache_langs);
+	g_free(lang_ids);
 	xmlrpc_env_clean(&env);
+
+	// the client can't be destroyed with abandoned rpcs still in flight
+	if (rpcs_in_flight > 0)
+		xmlrpc_client_event_loop_finish(client);
+	for (int i = 0; i < n_providers; i++)
+		xmlrpc_server_info_free(providers[i].server);
 	xmlrpc_client_destroy(client);
 	xmlrpc_client_teardown_global_const();
 
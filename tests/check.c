@@ -0,0 +1,288 @@
+/*
+ * check - correctness checks of the hot functions of subberthehut
+ *
+ * subberthehut.c is included directly, so its static functions can be
+ * called (like bench/microbench.c). Prints one line per check and exits
+ * with a failure if any of them failed. The inputs come from fixtures.h.
+ */
+
+#define main subberthehut_main
+#include "../subberthehut.c"
+#undef main
+
+#include <pthread.h>
+
+#include "fixtures.h"
+
+// the stack of the thread handling many results: 5000 of the old 32-byte struct sub_info
+// on the stack alone (about 160 KB) wouldn't fit
+#define CHECK_STACK_SIZE  (128 * 1024)
+#define CHECK_RESULTS     5000
+
+static FILE *out; // the original stdout, stdout itself is used by print_table()
+static int n_failed = 0;
+
+static void check(bool ok, const char *format, ...) {
+	va_list args;
+	va_start(args, format);
+	fprintf(out, "%s ", ok ? "ok  " : "FAIL");
+	vfprintf(out, format, args);
+	fputc('\n', out);
+	fflush(out);
+	va_end(args);
+
+	if (!ok)
+		n_failed++;
+}
+
+/*
+ * the byte at offset k of the test videos, a multiplicative hash so sums
+ * of the words don't cancel out.
+ */
+static unsigned char video_byte(uint64_t k) {
+	return (uint32_t)(k * 2654435761u) >> 24;
+}
+
+static int write_pattern(int fd, off_t start, off_t end) {
+	unsigned char buf[HASH_CHUNK];
+
+	for (off_t off = start; off < end; off += sizeof(buf)) {
+		size_t n = sizeof(buf);
+		if (end - off < (off_t)n)
+			n = end - off;
+		for (size_t i = 0; i < n; i++)
+			buf[i] = video_byte(off + i);
+		if (pwrite(fd, buf, n, off) != (ssize_t)n)
+			return errno;
+	}
+	return 0;
+}
+
+/*
+ * get_hash_and_filesize() against fixed vectors, computed with an
+ * independent implementation of the OpenSubtitles.org hash. Files smaller
+ * than 64 KiB only count their head (the tail was never read by the original
+ * stdio implementation), and a trailing partial word is ignored.
+ */
+static void check_hash() {
+	static const struct {
+		off_t size;
+		bool sparse;  // only the first and the last 100 bytes are written
+		uint64_t hash;
+	} vectors[] = {
+		{ 0, false, UINT64_C(0x0000000000000000) },
+		{ 1, false, UINT64_C(0x0000000000000001) },
+		{ 7, false, UINT64_C(0x0000000000000007) },
+		{ 8, false, UINT64_C(0x53b51778da3c9e08) },
+		{ 9, false, UINT64_C(0x53b51778da3c9e09) },
+		{ 65535, false, UINT64_C(0x02b45d13bd6d11cd) },
+		{ 65536, false, UINT64_C(0xbbe3f828406170aa) },
+		{ 65537, false, UINT64_C(0xaacfee1034515899) },
+		{ 131073, false, UINT64_C(0xc9ef07354f767cb6) },
+		{ 1000003, false, UINT64_C(0x0c2e4a748fc3fc39) },
+		{ 4LL * 1024 * 1024 * 1024 + 3, true, UINT64_C(0xa533c24d9926b336) },
+	};
+
+	for (size_t i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+		_cleanup_free_ char *path = temp_path("video");
+		_cleanup_close_ int fd = -1;
+		off_t size = vectors[i].size;
+		uint64_t hash = 0, filesize = 0;
+		int r;
+
+		if (!path || (fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) == -1) {
+			check(false, "hash %lld: failed to create the file", (long long)size);
+			continue;
+		}
+		unlink(path);
+
+		if (vectors[i].sparse)
+			r = ftruncate(fd, size) == -1 ? errno : 0;
+		else
+			r = write_pattern(fd, 0, size);
+		if (r == 0 && vectors[i].sparse)
+			r = write_pattern(fd, 0, 100);
+		if (r == 0 && vectors[i].sparse)
+			r = write_pattern(fd, size - 100, size);
+		if (r == 0)
+			r = get_hash_and_filesize(fd, &hash, &filesize);
+
+		check(r == 0 && hash == vectors[i].hash && filesize == (uint64_t)size,
+		      "hash %lld: %016" PRIx64 " (expected %016" PRIx64 ")",
+		      (long long)size, hash, vectors[i].hash);
+	}
+}
+
+/*
+ * a copy of payload with a newline inserted every width characters, and
+ * one more at the start if shift is set, so no chunk of sub_write() starts
+ * at a quad.
+ */
+static char *wrap_lines(const char *payload, size_t width, bool shift) {
+	size_t len = strlen(payload);
+	char *wrapped = malloc(len + len / width + 3);
+	size_t n = 0;
+
+	if (!wrapped)
+		return NULL;
+
+	if (shift)
+		wrapped[n++] = '\n';
+	for (size_t i = 0; i < len; i++) {
+		wrapped[n++] = payload[i];
+		if ((i + 1) % width == 0)
+			wrapped[n++] = '\n';
+	}
+	wrapped[n] = '\0';
+	return wrapped;
+}
+
+/*
+ * sub_write() of payload to a temporary file, compared to the expected
+ * subtitle. With expected NULL, sub_write() has to fail without leaving
+ * a file behind.
+ */
+static void check_sub_write_one(const char *name, const char *payload, const char *expected, size_t expected_len) {
+	_cleanup_free_ char *path = temp_path("sub.srt");
+	gchar *contents = NULL;
+	gsize len = 0;
+
+	if (!path || !payload) {
+		check(false, "sub_write %s: out of memory", name);
+		return;
+	}
+
+	int r = sub_write(payload, strlen(payload), path);
+	bool exists = g_file_get_contents(path, &contents, &len, NULL);
+
+	if (expected)
+		check(r == 0 && exists && len == expected_len && memcmp(contents, expected, len) == 0,
+		      "sub_write %s: %zu bytes of base64, %zu bytes of subtitle", name, strlen(payload), (size_t)len);
+	else
+		check(r != 0 && !exists, "sub_write %s: fails without a file", name);
+
+	g_free(contents);
+	unlink(path);
+}
+
+/*
+ * sub_write() on well-formed payloads with both kinds of padding, wrapped
+ * lines, chunks which don't start at a quad and sizes which aren't a
+ * multiple of B64_CHUNK, and on a truncated stream.
+ */
+static void check_sub_write() {
+	// the first sizes whose gzip ends with one or two padding characters
+	for (int pad = 1; pad <= 2; pad++) {
+		for (size_t size = 1000; size < 2000; size++) {
+			_cleanup_free_ char *sub = make_sub(size);
+			char *payload = sub ? gzip_base64(sub, size) : NULL;
+			size_t len = payload ? strlen(payload) : 0;
+
+			if (len >= 2 && (payload[len - 1] == '=') + (payload[len - 2] == '=') == pad) {
+				check_sub_write_one(pad == 1 ? "'=' padding" : "'==' padding", payload, sub, size);
+				g_free(payload);
+				break;
+			}
+			g_free(payload);
+		}
+	}
+
+	size_t size = 3 * 1024 * 1024 + 17;
+	_cleanup_free_ char *sub = make_sub(size);
+	char *payload = sub ? gzip_base64(sub, size) : NULL;
+	_cleanup_free_ char *wrapped = payload ? wrap_lines(payload, 76, false) : NULL;
+	_cleanup_free_ char *shifted = payload ? wrap_lines(payload, 76, true) : NULL;
+
+	check(payload && strlen(payload) > B64_CHUNK && strlen(payload) % B64_CHUNK != 0,
+	      "sub_write: the payload isn't a multiple of B64_CHUNK");
+	check_sub_write_one("multi-MB", payload, sub, size);
+	check_sub_write_one("multi-MB with newlines", wrapped, sub, size);
+	check_sub_write_one("multi-MB split inside quads", shifted, sub, size);
+
+	// the end of the gzip stream is missing
+	if (payload)
+		payload[strlen(payload) / 2 / 4 * 4] = '\0';
+	check_sub_write_one("truncated", payload, NULL, 0);
+
+	g_free(payload);
+}
+
+struct results_check {
+	struct file_job job;
+	int sel;
+	int r;
+};
+
+static void *results_check_run(void *data) {
+	struct results_check *c = data;
+
+	c->r = read_sub_infos(&c->job);
+	if (c->r == 0)
+		c->r = choose_from_results(c->job.filename, c->job.sub_infos, c->job.n_sub_infos, &c->sel);
+	return NULL;
+}
+
+/*
+ * read_sub_infos() and choose_from_results() (printing the table) on
+ * CHECK_RESULTS results in a thread with a stack of CHECK_STACK_SIZE,
+ * i.e. the results must not be kept on the stack.
+ */
+static void check_many_results() {
+	_cleanup_xmlrpc_ xmlrpc_value *results = xmlrpc_array_new(&env);
+	struct results_check c = { .job.filename = "Some.Movie.2000.1080p.BluRay.x264-GROUP3.mkv" };
+	pthread_attr_t attr;
+	pthread_t thread;
+
+	for (int i = 0; i < CHECK_RESULTS; i++) {
+		// only the last result is a hash match
+		_cleanup_xmlrpc_ xmlrpc_value *result = make_result(i, i == CHECK_RESULTS - 1);
+		xmlrpc_array_append_item(&env, results, result);
+	}
+	if (env.fault_occurred) {
+		check(false, "%d results: failed to build them: %s", CHECK_RESULTS, env.fault_string);
+		return;
+	}
+
+	c.job.results = results;
+	never_ask = true;
+	quiet = 0;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, CHECK_STACK_SIZE);
+	int r = pthread_create(&thread, &attr, results_check_run, &c);
+	pthread_attr_destroy(&attr);
+	if (r != 0) {
+		check(false, "%d results: failed to start the thread: %s", CHECK_RESULTS, strerror(r));
+		return;
+	}
+	pthread_join(thread, NULL);
+
+	check(c.r == 0 && c.job.n_sub_infos == CHECK_RESULTS && c.sel == CHECK_RESULTS - 1,
+	      "%d results with a stack of %d KiB: hash match %d selected", CHECK_RESULTS, CHECK_STACK_SIZE / 1024, c.sel + 1);
+	check(c.job.n_sub_infos == CHECK_RESULTS && c.job.sub_infos[1].lang == c.job.sub_infos[2].lang &&
+	      strcmp(c.job.sub_infos[0].lang, "ger") == 0 && strcmp(c.job.sub_infos[1].lang, "eng") == 0,
+	      "%d results: the languages are interned", CHECK_RESULTS);
+
+	free_sub_infos(&c.job);
+}
+
+int main() {
+	int out_fd = dup(STDOUT_FILENO);
+	out = out_fd != -1 ? fdopen(out_fd, "w") : NULL;
+	if (!out || !freopen("/dev/null", "w", stdout)) {
+		log_err("failed to duplicate stdout: %m");
+		return EXIT_FAILURE;
+	}
+
+	xmlrpc_env_init(&env);
+
+	check_hash();
+	check_sub_write();
+	check_many_results();
+
+	if (n_failed > 0)
+		fprintf(out, "%d checks failed.\n", n_failed);
+	fclose(out);
+
+	return n_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,79 @@
+/*
+ * fixtures.h - generated inputs shared by tests/check.c and bench/microbench.c
+ *
+ * Included after subberthehut.c, so its helpers and the global xmlrpc env
+ * can be used. Temporary files are created in $TMPDIR (default /tmp).
+ */
+
+#ifndef SUBBERTHEHUT_FIXTURES_H
+#define SUBBERTHEHUT_FIXTURES_H
+
+static char *temp_path(const char *name) {
+	const char *dir = getenv("TMPDIR");
+	char *path = NULL;
+	if (asprintf(&path, "%s/subberthehut-%s-%d-%s", dir ? dir : "/tmp",
+	             program_invocation_short_name, getpid(), name) == -1)
+		return NULL;
+	return path;
+}
+
+/*
+ * size bytes of subtitle text, the lines differ so the compressed size
+ * follows the size.
+ */
+static char *make_sub(size_t size) {
+	char *sub = malloc(size + 1);
+	if (!sub)
+		return NULL;
+
+	for (size_t i = 0, line = 1; i < size; line++) {
+		char buf[128];
+		int n = snprintf(buf, sizeof(buf), "%zu\n00:%02zu:%02zu,000 --> 00:%02zu:%02zu,500\nLine %zu, %x.\n\n",
+		                 line, line / 60 % 60, line % 60, line / 60 % 60, line % 60, line, (unsigned)(line * 2654435761u));
+		for (int j = 0; j < n && i < size; j++)
+			sub[i++] = buf[j];
+	}
+	sub[size] = '\0';
+	return sub;
+}
+
+/*
+ * gzips and base64 encodes len bytes, like the server does.
+ */
+static char *gzip_base64(const char *data, size_t len) {
+	uLongf gz_len = compressBound(len) + 32;
+	_cleanup_free_ unsigned char *gz = malloc(gz_len);
+	z_stream strm = {0};
+
+	if (!gz || deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return NULL;
+
+	strm.next_in = (unsigned char *)data;
+	strm.avail_in = len;
+	strm.next_out = gz;
+	strm.avail_out = gz_len;
+	int z_ret = deflate(&strm, Z_FINISH);
+	gz_len = strm.total_out;
+	deflateEnd(&strm);
+	if (z_ret != Z_STREAM_END)
+		return NULL;
+
+	return g_base64_encode(gz, gz_len);
+}
+
+/*
+ * the ith of a list of search results, with the fields read_sub_infos()
+ * uses. Every third one is German, the others are English.
+ */
+static xmlrpc_value *make_result(int i, bool hash_match) {
+	char id[16], size[16], name[64];
+	snprintf(id, sizeof(id), "%d", i + 1);
+	snprintf(size, sizeof(size), "%d", 40000 + i);
+	snprintf(name, sizeof(name), "Some.Movie.%d.720p.HDTV.x264-GROUP%d", 1990 + i % 30, i % 7);
+
+	return xmlrpc_build_value(&env, "{s:s,s:s,s:s,s:s,s:s,s:s}",
+		"IDSubtitleFile", id, "MatchedBy", hash_match ? "moviehash" : "fulltext", "SubSize", size,
+		"SubLanguageID", i % 3 ? "eng" : "ger", "MovieReleaseName", name, "SubFileName", name);
+}
+
+#endif